@@ -7,7 +7,9 @@
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * To get buffers for a run of consecutive blocks, call bread_multi.
+// * After changing buffer data, call bwrite to write it to disk,
+//     or bwrite_multi to write several buffers at once.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -23,17 +25,56 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
-  
-  struct buf buf[NBUF + 1];
+// The hashtable is open-addressed: a block lives in one of the
+// HWIN slots starting at bhash(dev, blockno), and every lookup
+// examines all of them. Its size follows the number of buffers.
+#define HSIZE (4*(NBUF+2))
+#define HWIN  (HSIZE < 32 ? HSIZE : 32)
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  uint32 hashtable[FSSIZE];
+#if NBUF+1 > HIDXMAX
+#error "NBUF too large for the hashtable encoding"
+#endif
 
+// A lock-free Michael-Scott queue of unreferenced buffers,
+// linked through buf.qnext. Its first buf is a dummy node.
+struct bqueue {
   uint64 head;
   uint64 tail;
+  int len;           // approximate number of buffers queued
+};
+
+// Replacement follows 2Q. A buffer whose block has not been
+// used again since it was read waits on the probation queue
+// a1; the victim is normally taken from there, so a large
+// sequential scan only churns a1. A buffer that was hit while
+// cached (b->hot), or that holds metadata, goes to the
+// protected queue am, where CLOCK gives hot buffers a second
+// chance. Each queue has a dummy buf of its own, hence NBUF+2.
+#define A1MAX (NBUF/4)  // a1 size above which it supplies victims
+
+struct {
+  
+  struct buf buf[NBUF + 2];
+
+  // Lock-free index from (dev, blockno) to cached buffer;
+  // see buf.h for the layout of an entry. An entry's
+  // reference count is updated with CAS.
+  uint64 hashtable[HSIZE];
+
+  struct bqueue a1;  // probation
+  struct bqueue am;  // protected
+
+  // per block class counters.
+  uint64 hits[NBCLASS];    // bget() found the block cached
+  uint64 misses[NBCLASS];  // bget() had to recycle a buffer
+  uint64 evicts[NBCLASS];  // a cached block was replaced
+
+  // read-ahead counters.
+  uint64 ra_issued;  // blocks read ahead
+  uint64 ra_hits;    // read-ahead blocks later read
+  uint64 ra_wasted;  // read-ahead blocks evicted unread
+
+  uint64 exchanged;  // pages given to readers by bexchange()
 } bcache;
 
 inline int CAS64(uint64* ptr, uint64* expected, uint64 desired) {
@@ -44,7 +85,8 @@ inline int CAS32(uint32* ptr, uint32* expected, uint32 desired) {
   return __atomic_compare_exchange_n(ptr, expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 }
 
-void enqueue(struct buf *b) {
+static void
+enqueue(struct bqueue *q, struct buf *b) {
   uint32 expect = 0;
   if (!CAS32(&b->in_q, &expect, 1)) return;
 
@@ -52,134 +94,456 @@ void enqueue(struct buf *b) {
   b->qnext = CNTPTR(0LL, PTRNULL);
   uint64 tail, next;
   while (1) {
-    tail = bcache.tail;
+    tail = q->tail;
     next = bcache.buf[PTR(tail)].qnext;
-    if (tail == bcache.tail) {
+    if (tail == q->tail) {
       if (PTR(next) == PTRNULL) {
         if (CAS64(&bcache.buf[PTR(tail)].qnext, &next, CNTPTR(CNT(next) + 1, idx)))
           break;
       } else {
-        CAS64(&bcache.tail, &tail, CNTPTR(CNT(tail) + 1, PTR(next)));
+        CAS64(&q->tail, &tail, CNTPTR(CNT(tail) + 1, PTR(next)));
       }
     }
   }
-  CAS64(&bcache.tail, &tail, CNTPTR(CNT(tail) + 1, idx));
+  CAS64(&q->tail, &tail, CNTPTR(CNT(tail) + 1, idx));
+  __atomic_fetch_add(&q->len, 1, __ATOMIC_RELAXED);
 }
 
-struct buf *dequeue() {
+static struct buf *
+dequeue(struct bqueue *q) {
   uint64 head, tail, next;
   struct buf *ret;
   while(1) {
-    head = bcache.head;
-    tail = bcache.tail;
+    head = q->head;
+    tail = q->tail;
     next = bcache.buf[PTR(head)].qnext;
-    if (head == bcache.head)
+    if (head == q->head)
     {
       if (PTR(head) == PTR(tail)) {
         if (PTR(next) == PTRNULL) return 0;
-        CAS64(&bcache.tail, &tail, CNTPTR(CNT(tail) + 1, PTR(next)));
+        CAS64(&q->tail, &tail, CNTPTR(CNT(tail) + 1, PTR(next)));
       } else {
         ret = &bcache.buf[PTR(head)];
-        if(CAS64(&bcache.head, &head, CNTPTR(CNT(head) + 1, PTR(next)))) {
+        if(CAS64(&q->head, &head, CNTPTR(CNT(head) + 1, PTR(next)))) {
           __atomic_store_n(&ret->in_q, 0, __ATOMIC_RELEASE);
           break;
         }
       }
     }
   }
+  __atomic_fetch_sub(&q->len, 1, __ATOMIC_RELAXED);
   return ret;
 }
 
+// Blocks of these classes skip probation.
+static int
+bprotected(int class)
+{
+  return class == BC_DIR || class == BC_INODE || class == BC_BITMAP ||
+         class == BC_INDIRECT || class == BC_META;
+}
+
+// Blocks of these classes are read once in sequence,
+// and never earn protection.
+static int
+bscan(int class)
+{
+  return class == BC_LOG || class == BC_SWAP;
+}
+
+// Queue b, which nobody references any more, for replacement.
+static void
+bidle(struct buf *b)
+{
+  if(bprotected(b->class) || (b->hot && !bscan(b->class)))
+    enqueue(&bcache.am, b);
+  else
+    enqueue(&bcache.a1, b);
+}
+
+static void
+qinit(struct bqueue *q, struct buf *dummy)
+{
+  q->head = q->tail = CNTPTR(0LL, dummy - bcache.buf);
+  q->len = 0;
+  dummy->qnext = CNTPTR(0LL, PTRNULL);
+}
+
 void
 binit(void)
 {
-  struct buf *b = bcache.buf+NBUF;
-  // init hashmap
-  for (int i = 0; i < FSSIZE; i++) 
-    bcache.hashtable[i] = REFCNT_IDX(0, NONE);
-  // init dummy node for queue
-  bcache.head = bcache.tail = CNTPTR(0LL, NBUF);
-  initsleeplock(&b->lock, "buffer");
-  b->data = kalloc();
-  b->qnext = CNTPTR(0LL, PTRNULL);
-  b->in_q = 0;
-  // init data node in queue
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
+  struct buf *b;
+
+  for(b = bcache.buf; b < bcache.buf+NBUF+2; b++){
     b->data = kalloc();
     b->in_q = 0;
-    enqueue(b);
+    b->hslot = -1;
     initsleeplock(&b->lock, "buffer");
   }
+  // the last two bufs start out as the queues' dummy nodes.
+  qinit(&bcache.a1, bcache.buf+NBUF);
+  qinit(&bcache.am, bcache.buf+NBUF+1);
+  for(b = bcache.buf; b < bcache.buf+NBUF; b++)
+    enqueue(&bcache.a1, b);
+}
+
+static int
+bhash(uint dev, uint blockno)
+{
+  uint64 h = HKEY(dev, blockno) * 0x9e3779b97f4a7c15ULL;
+  return (h >> 32) % HSIZE;
+}
+
+// Find the entry for key among the slots of its window.
+// Return the slot, or -1; *e is set to the entry.
+static int
+hfind(uint64 key, int home, uint64 *e)
+{
+  for(int i = 0; i < HWIN; i++){
+    int p = (home + i) % HSIZE;
+    uint64 v = __atomic_load_n(&bcache.hashtable[p], __ATOMIC_SEQ_CST);
+    if((v & H_LIVE) && HKEYOF(v) == key){
+      *e = v;
+      return p;
+    }
+  }
+  return -1;
+}
 
+// We have claimed slot mine for key with a busy entry. Since
+// two processes can miss on the same block at once, look for
+// another entry for key: both claim before they look, so at
+// least one of them sees the other. Give way to a finished
+// entry, or to a busy one nearer the start of the window;
+// wait for a busy one further along to finish or give way.
+// Return 1 if we may keep our slot, 0 if we must give it up.
+static int
+hresolve(uint64 key, int home, int mine)
+{
+  int mydist = (mine - home + HSIZE) % HSIZE;
+
+  while(1){
+    int wait = 0;
+    for(int i = 0; i < HWIN; i++){
+      int p = (home + i) % HSIZE;
+      if(p == mine)
+        continue;
+      uint64 v = __atomic_load_n(&bcache.hashtable[p], __ATOMIC_SEQ_CST);
+      if(!(v & H_LIVE) || HKEYOF(v) != key)
+        continue;
+      if(!(v & H_BUSY) || i < mydist)
+        return 0;
+      wait = 1;
+    }
+    if(!wait)
+      return 1;
+  }
 }
 
+// Choose an unreferenced buffer to recycle, following 2Q, and
+// remove its old block from the hashtable.
+// Return 0 if every buffer is in use.
+static struct buf*
+bvictim(void)
+{
+  struct buf *b;
+  int from_a1;
 
-int bhash(uint dev, uint blockno) {
-  int hash = dev ^ blockno;
-  hash = hash * 31 + blockno;
-  if (hash < 0) hash = -hash;
-  return hash % NBUFBUC;
+  while(1){
+    from_a1 = bcache.a1.len > A1MAX || bcache.am.len <= 0;
+    b = dequeue(from_a1 ? &bcache.a1 : &bcache.am);
+    if(b == 0){
+      from_a1 = !from_a1;
+      b = dequeue(from_a1 ? &bcache.a1 : &bcache.am);
+    }
+    if(b == 0)
+      return 0;
+    // b's fields are stable: until we return it, no other
+    // thread can dequeue b and reuse it.
+    if(b->hslot < 0)
+      break;
+    uint64 e = __atomic_load_n(&bcache.hashtable[b->hslot], __ATOMIC_SEQ_CST);
+    if(HREF(e) > 0){
+      // bget() found b again after it was queued;
+      // bput() will queue it when it is released.
+      continue;
+    }
+    if(b->hot && !bscan(b->class)){
+      // used again since it was queued: promote it
+      // from a1, or give it a second chance in am.
+      b->hot = 0;
+      enqueue(&bcache.am, b);
+      continue;
+    }
+    uint64 expect = HENTRY(HKEY(b->dev, b->blockno), 0, b - bcache.buf);
+    if(CAS64(&bcache.hashtable[b->hslot], &expect, 0)){
+      b->hslot = -1;
+      __atomic_fetch_add(&bcache.evicts[b->class], 1, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  if(b->flags & B_RA){
+    b->flags &= ~B_RA;
+    __atomic_fetch_add(&bcache.ra_wasted, 1, __ATOMIC_RELAXED);
+  }
+  return b;
 }
 
+static void bput(struct buf*);
+static void bra_hit(struct buf*);
+
+#define BG_NOWAIT 0x1  // return 0 rather than panic if no buffer is free
+#define BG_RA     0x2  // read-ahead: return 0 if the block is cached
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// class is a BC_ hint for the replacement policy; BC_ANY
+// leaves a cached block's class alone.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int class, int flags)
 {
-  if (dev != 1) panic("bget");
-  struct buf *b;
-  b = 0;
+  uint64 key = HKEY(dev, blockno), e;
+  int home = bhash(dev, blockno);
+  struct buf *b = 0;
+  int p;
+
+  if(dev > HDEVMAX)
+    panic("bget: dev");
   while(1) {
-    uint32 refcnt_idx = bcache.hashtable[blockno];
     // Is the block already cached?
-    if (IDX(refcnt_idx) != NONE) {
-      if (CAS32(&bcache.hashtable[blockno], &refcnt_idx, INC_REFCNT(refcnt_idx))){
-        if(b) enqueue(b);
-        acquiresleep(&bcache.buf[IDX(refcnt_idx)].lock);
-        return &bcache.buf[IDX(refcnt_idx)];
+    if((p = hfind(key, home, &e)) >= 0){
+      if(flags & BG_RA){
+        if(b) enqueue(&bcache.a1, b);
+        return 0;
       }
-    } else {
-      // Recycle the least recently used (LRU) unused buffer.
-      if (!b) {
-        while (1) {
-          b = dequeue();
-          if (!b) panic("bget: no buffers");
-          // b->blockno is threadsafe since until this func return, 
-          // other thread cannot deque same buf, and reset its blockno
-          uint32 blockno = b->blockno, expect = REFCNT_IDX(0, IDX(bcache.hashtable[blockno]));
-          if (CAS32(&bcache.hashtable[blockno], &expect, REFCNT_IDX(0, NONE)))
-            break;
-        }
-      }
-      // assert(refcnt_idx = REFCNT_IDX(0, NONE));
-      int idx = b - bcache.buf;
-      if (CAS32(&bcache.hashtable[blockno], &refcnt_idx, REFCNT_IDX(1, idx))){
+      if(e & H_BUSY)
+        continue;  // another bget() is still inserting it
+      if(HREF(e) == HREFMAX)
+        panic("bget: refcnt");
+      if(CAS64(&bcache.hashtable[p], &e, e + HREF1)){
+        if(b) enqueue(&bcache.a1, b);
+        b = &bcache.buf[HIDX(e)];
+        b->hot = 1;
         acquiresleep(&b->lock);
-        b->valid = 0;
-        b->dev = dev;
-        b->blockno = blockno;
+        if(class != BC_ANY)
+          b->class = class;
+        __atomic_fetch_add(&bcache.hits[b->class], 1, __ATOMIC_RELAXED);
         return b;
       }
+      continue;
+    }
+
+    // Not cached.
+    // Recycle the least recently used (LRU) unused buffer.
+    if(!b && (b = bvictim()) == 0){
+      if(flags & (BG_NOWAIT|BG_RA))
+        return 0;
+      panic("bget: no buffers");
+    }
+
+    // Claim a free slot in the window. If there is none, all
+    // its blocks are cached: give b back, let other threads
+    // run, and try again. Each try recycles another buffer,
+    // so in time one of the window's blocks is evicted.
+    uint64 busy = HENTRY(key, 1, b - bcache.buf) | H_BUSY;
+    p = -1;
+    for(int i = 0; i < HWIN; i++){
+      e = 0;
+      if(CAS64(&bcache.hashtable[(home + i) % HSIZE], &e, busy)){
+        p = (home + i) % HSIZE;
+        break;
+      }
+    }
+    if(p < 0){
+      enqueue(&bcache.a1, b);
+      b = 0;
+      if(flags & BG_RA)
+        return 0;
+      yield();
+      continue;
+    }
+    if(!hresolve(key, home, p)){
+      __atomic_store_n(&bcache.hashtable[p], 0, __ATOMIC_SEQ_CST);
+      continue;
     }
+
+    // b is unreferenced, so nobody else holds its lock.
+    acquiresleep(&b->lock);
+    b->valid = 0;
+    b->dev = dev;
+    b->blockno = blockno;
+    b->hslot = p;
+    b->class = class != BC_ANY ? class : BC_DATA;
+    b->hot = 0;
+    __atomic_store_n(&bcache.hashtable[p], busy & ~H_BUSY, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&bcache.misses[b->class], 1, __ATOMIC_RELAXED);
+    return b;
   }
-  
 }
 
-// Return a locked buf with the contents of the indicated block.
+// Return a locked buf with the contents of the indicated block,
+// of block class class.
 struct buf*
-bread(uint dev, uint blockno)
+bread_class(uint dev, uint blockno, int class)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, class, 0);
   if(!b->valid) {
     virtio_disk_rw(b, 0);
     b->valid = 1;
   }
+  bra_hit(b);
   return b;
 }
 
+// Return a locked buf with the contents of the indicated block.
+struct buf*
+bread(uint dev, uint blockno)
+{
+  return bread_class(dev, blockno, BC_ANY);
+}
+
+// Return a locked buf for the indicated block filled with zeros
+// instead of its contents on disk, for a newly allocated block
+// that the caller will overwrite.
+struct buf*
+bread_zero(uint dev, uint blockno, int class)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, class, 0);
+  memset(b->data, 0, BSIZE);
+  b->valid = 1;
+  bra_hit(b);
+  return b;
+}
+
+// Read up to n consecutive blocks starting at blockno into bs[],
+// fetching the ones that are not cached with as few disk
+// requests as possible. The run is cut short if the cache runs
+// out of free buffers; at least one block is always returned.
+// Return the number of locked bufs placed in bs[].
+int
+bread_multi(uint dev, uint blockno, int n, struct buf **bs, int class)
+{
+  int i, j, got;
+
+  if(n > NBRUN)
+    n = NBRUN;
+  bs[0] = bget(dev, blockno, class, 0);
+  for(got = 1; got < n; got++){
+    if((bs[got] = bget(dev, blockno + got, class, BG_NOWAIT)) == 0)
+      break;
+  }
+
+  // start a request for each run of missing blocks, then
+  // wait for all of them.
+  for(i = 0; i < got; i = j){
+    for(j = i; j < got && !bs[j]->valid; j++)
+      ;
+    if(j > i)
+      virtio_disk_submitv(bs+i, j-i, 0);
+    else
+      j++;
+  }
+  for(i = 0; i < got; i++){
+    if(!bs[i]->valid){
+      virtio_disk_wait(bs[i]);
+      bs[i]->valid = 1;
+    }
+    bra_hit(bs[i]);
+  }
+  return got;
+}
+
+// Start reading the n consecutive blocks at blockno into the cache
+// without waiting. Blocks that are already cached are skipped; each
+// buffer is unlocked and released by biodone() when its read
+// completes. Return the number of blocks actually requested.
+int
+bprefetch(uint dev, uint blockno, int n)
+{
+  struct buf *bs[NBRUN];
+  int nb = 0, tot = 0;
+
+  for(int i = 0; i < n; i++){
+    struct buf *b = bget(dev, blockno + i, BC_DATA, BG_RA);
+    if(nb > 0 && (b == 0 || nb == NBRUN)){
+      virtio_disk_submitv(bs, nb, 0);
+      tot += nb;
+      nb = 0;
+    }
+    if(b){
+      b->flags |= B_ASYNC | B_RA;
+      bs[nb++] = b;
+    }
+  }
+  if(nb > 0){
+    virtio_disk_submitv(bs, nb, 0);
+    tot += nb;
+  }
+  __atomic_fetch_add(&bcache.ra_issued, tot, __ATOMIC_RELAXED);
+  return tot;
+}
+
+// Called by the disk interrupt when an asynchronous read of b
+// has finished: mark it valid, unlock it and drop the reference
+// that bprefetch() took.
+void
+biodone(struct buf *b)
+{
+  b->flags &= ~B_ASYNC;
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
+}
+
+// Count a read of a buffer that read-ahead brought in. Must be locked.
+// The read is the block's first use, so it does not make b hot.
+static void
+bra_hit(struct buf *b)
+{
+  if(b->flags & B_RA){
+    b->flags &= ~B_RA;
+    b->hot = 0;
+    __atomic_fetch_add(&bcache.ra_hits, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// If b holds a block that nobody has used since it was read
+// from disk, and nobody else holds b, give b's page to the
+// caller in exchange for page pa. b is left invalid, so the
+// next bread() of the block reads it again. Such a block is
+// most likely part of a large file being read once, and not
+// worth keeping. Returns the page with the block, or 0 if
+// the caller should copy it instead.
+// Caller must hold b->lock.
+uchar*
+bexchange(struct buf *b, uchar *pa)
+{
+  uchar *old;
+
+  if(b->hot || !b->valid || b->hslot < 0)
+    return 0;
+  uint64 e = __atomic_load_n(&bcache.hashtable[b->hslot], __ATOMIC_SEQ_CST);
+  if(HREF(e) != 1)
+    return 0;  // pinned by the log or mmap, or wanted by another reader
+  old = b->data;
+  b->data = pa;
+  b->valid = 0;
+  __atomic_fetch_add(&bcache.exchanged, 1, __ATOMIC_RELAXED);
+  return old;
+}
+
+// Number of read-ahead blocks evicted before anyone read them.
+uint64
+bra_wasted(void)
+{
+  return __atomic_load_n(&bcache.ra_wasted, __ATOMIC_RELAXED);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -189,47 +553,70 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Write the n locked bufs bs[0..n-1] to disk, sending each run
+// of consecutive blocks as one request.
+void
+bwrite_multi(struct buf **bs, int n)
+{
+  int i, j;
+
+  for(i = 0; i < n; i++)
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwrite_multi");
+  for(i = 0; i < n; i = j){
+    for(j = i+1; j < n && bs[j]->blockno == bs[j-1]->blockno + 1; j++)
+      ;
+    virtio_disk_submitv(bs+i, j-i, 1);
+  }
+  for(i = 0; i < n; i++)
+    virtio_disk_wait(bs[i]);
+}
+
+// Add delta (+1 or -1) to the reference count in b's
+// hashtable entry and return the new count.
+static int
+bref(struct buf *b, int delta)
+{
+  uint64 *slot = &bcache.hashtable[b->hslot], e;
+
+  do {
+    e = __atomic_load_n(slot, __ATOMIC_SEQ_CST);
+    if(!(e & H_LIVE) || (e & H_BUSY) || HIDX(e) != b - bcache.buf ||
+       HREF(e) + delta < 0 || HREF(e) + delta > HREFMAX)
+      panic("bref");
+  } while(!CAS64(slot, &e, delta > 0 ? e + HREF1 : e - HREF1));
+  return HREF(e) + delta;
+}
+
+// Drop a reference to b, and put it back on the
+// free queue once nobody uses it.
+static void
+bput(struct buf *b)
+{
+  if(bref(b, -1) == 0)
+    bidle(b);
+}
+
 // Release a locked buffer.
 // Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
-  if (b->dev != 1) panic("brelse");
-  
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
-  int blockno = b->blockno;
-  while (1) {
-    uint32 refcnt_idx = bcache.hashtable[blockno];
-    // assert(blockno == b->blockno && IDX(refcnt_idx) != NONE && REFCNT(refcnt_idx) > 0);
-    int new_refcnt = REFCNT(refcnt_idx) - 1, idx = IDX(refcnt_idx);
-    if (CAS32(&bcache.hashtable[blockno], &refcnt_idx, REFCNT_IDX(new_refcnt, idx))) {
-      if (new_refcnt == 0) enqueue(b);
-      return;
-    }
-  }
+  bput(b);
 }
 
 void
 bpin(struct buf *b) {
-  int blockno = b->blockno;
-  uint32 refcnt_idx;
-  do {
-    refcnt_idx = bcache.hashtable[blockno];
-    // assert(blockno == b->blockno && IDX(refcnt_idx) != NONE && REFCNT(refcnt_idx) > 0);
-  } while(!CAS32(&bcache.hashtable[blockno], &refcnt_idx, INC_REFCNT(refcnt_idx)));
+  bref(b, 1);
 }
 
 void
 bunpin(struct buf *b) {
-  int blockno = b->blockno;
-  uint32 refcnt_idx;
-  do {
-    refcnt_idx = bcache.hashtable[blockno];
-    // assert(blockno == b->blockno && IDX(refcnt_idx) != NONE && REFCNT(refcnt_idx) > 1);
-  } while(!CAS32(&bcache.hashtable[blockno], &refcnt_idx, DEC_REFCNT(refcnt_idx)));
+  bput(b);
 }
 
 void
@@ -237,7 +624,7 @@ bunpin2(uint64 addr)
 {
   
   struct buf *b;
-  for(b = bcache.buf; b <= bcache.buf+NBUF; b++){
+  for(b = bcache.buf; b < bcache.buf+NBUF+2; b++){
     if ((uint64)b->data == addr) {
       bunpin(b);
       return;
@@ -247,3 +634,38 @@ bunpin2(uint64 addr)
   
 }
 
+
+static char *bclassname[NBCLASS] = {
+[BC_DATA]     "data",
+[BC_DIR]      "dir",
+[BC_INODE]    "inode",
+[BC_BITMAP]   "bitmap",
+[BC_INDIRECT] "indirect",
+[BC_META]     "super",
+[BC_LOG]      "log",
+[BC_SWAP]     "swap",
+};
+
+// report cache statistics through the stats device.
+int
+statsbio(char *buf, int sz)
+{
+  int n, hits = 0, misses = 0;
+
+  for(int c = 0; c < NBCLASS; c++){
+    hits += bcache.hits[c];
+    misses += bcache.misses[c];
+  }
+  n = snprintf(buf, sz, "--- buffer cache: size %d hits %d misses %d\n",
+               NBUF, hits, misses);
+  n += snprintf(buf+n, sz-n, "probation %d protected %d\n",
+                bcache.a1.len, bcache.am.len);
+  for(int c = 0; c < NBCLASS; c++)
+    n += snprintf(buf+n, sz-n, "%s: hits %d misses %d evictions %d\n", bclassname[c],
+                  (int)bcache.hits[c], (int)bcache.misses[c], (int)bcache.evicts[c]);
+  n += snprintf(buf+n, sz-n, "--- readahead: issued %d hits %d wasted %d\n",
+                (int)bcache.ra_issued, (int)bcache.ra_hits, (int)bcache.ra_wasted);
+  n += snprintf(buf+n, sz-n, "--- zero-copy read: pages exchanged %d\n",
+                (int)bcache.exchanged);
+  return n;
+}
@@ -3,21 +3,55 @@
 #define PTR(x) ((x) & PTRNULL)
 #define CNTPTR(x, y) (((x) << 32) | (y))
 
-#define REFCNT(x) ((x) >> 5)
-#define NONE 0x1f
-#define IDX(x) ((x) & NONE)
-#define REFCNT_IDX(x, y) (((x) << 5) | (y))
-#define INC_REFCNT(x) REFCNT_IDX((REFCNT(x)+1), IDX(x))
-#define DEC_REFCNT(x) REFCNT_IDX((REFCNT(x)-1), IDX(x))
+// a bcache hashtable entry: the block's dev and blockno,
+// flags, a reference count and the index of its buffer.
+// 0 is an empty slot.
+//   bits 0-31   blockno
+//   bits 32-37  dev
+//   bit  38     H_BUSY, being inserted by bget()
+//   bit  39     H_LIVE, the slot holds an entry
+//   bits 40-49  reference count
+//   bits 50-63  buffer index
+#define HKEY(dev, blockno) (((uint64)(dev) << 32) | (blockno))
+#define HKEYOF(e) ((e) & 0x3fffffffffULL)
+#define HDEVMAX 0x3f
+#define H_BUSY (1ULL << 38)
+#define H_LIVE (1ULL << 39)
+#define HREF1 (1ULL << 40)
+#define HREF(e) ((int)(((e) >> 40) & 0x3ff))
+#define HREFMAX 0x3ff
+#define HIDX(e) ((int)((e) >> 50))
+#define HIDXMAX 0x3fff
+#define HENTRY(key, ref, idx) \
+  (H_LIVE | (key) | ((uint64)(ref) << 40) | ((uint64)(idx) << 50))
+
+#define B_ASYNC 0x1  // release the buf when its disk read completes
+#define B_RA    0x2  // filled by read-ahead, not yet read by anyone
+
+// block classes, hints for the replacement policy.
+#define BC_ANY     -1  // bread(): keep the class a cached block has
+#define BC_DATA     0  // file contents
+#define BC_DIR      1  // directory contents
+#define BC_INODE    2  // inode blocks
+#define BC_BITMAP   3  // free-block bitmap
+#define BC_INDIRECT 4  // indirect blocks
+#define BC_META     5  // superblock
+#define BC_LOG      6  // log blocks
+#define BC_SWAP     7  // swap pages
+#define NBCLASS     8
 
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int flags;   // B_ASYNC, B_RA
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uchar *data;
   uint64 qnext; // saved lru
   uint32 in_q;
+  int hslot;    // bcache hashtable slot, or -1
+  int class;    // BC_ class of the cached block
+  int hot;      // used again since it was queued for replacement?
 };
 
@@ -0,0 +1,172 @@
+// Name cache.
+//
+// Remembers the results of directory lookups, so that namex()
+// can resolve a path element without locking the directory and
+// reading its blocks. An entry maps (dev, directory inum, name)
+// to the inum it names, or to 0 if the directory has no such
+// name, so a failed lookup (such as sh trying each directory of
+// its search path) is cached too.
+//
+// Entries are only added or changed by a process holding the
+// directory's inode lock: namex() after dirlookup(), dirlink()
+// and dirunlink(). So an entry always agrees with the directory.
+// When a directory inode is freed, iput() drops its entries
+// before the inum can be reused.
+//
+// Readers take no lock. Writers hold dcache.lock and make
+// dcache.seq odd while they change the table; a reader that
+// sees seq change (or odd) while it looked ignores what it read.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+#include "stat.h"
+
+#define NDHASH 64   // buckets
+#define NDWAY   4   // entries per bucket
+
+struct dentry {
+  uint dev;
+  uint pinum;          // directory; 0 if the entry is unused
+  uint inum;           // 0 for "no such name"
+  char name[DIRSIZ];
+};
+
+struct {
+  struct spinlock lock;
+  uint seq;
+  struct dentry ent[NDHASH][NDWAY];
+  uchar hand[NDHASH];  // next way to replace
+
+  uint64 hits;       // found, including...
+  uint64 neghits;    // ...found to be absent
+  uint64 misses;
+} dcache;
+
+void
+dcacheinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static uint
+dhash(uint dev, uint pinum, char *name)
+{
+  uint h = 2166136261 ^ dev ^ (pinum * 16777619);
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h % NDHASH;
+}
+
+static struct dentry*
+dfind(uint dev, uint pinum, char *name)
+{
+  struct dentry *d = dcache.ent[dhash(dev, pinum, name)];
+
+  for(int i = 0; i < NDWAY; i++)
+    if(d[i].pinum == pinum && d[i].dev == dev && namecmp(name, d[i].name) == 0)
+      return &d[i];
+  return 0;
+}
+
+// Look up name in directory (dev, pinum). If it is cached,
+// set *inum to the inum it names (0 if none) and *seq to pass
+// to dcache_valid() once the caller has taken a reference to
+// the inode, and return 1. Otherwise return 0.
+int
+dcache_lookup(uint dev, uint pinum, char *name, uint *inum, uint *seq)
+{
+  struct dentry *d;
+
+  for(int tries = 0; tries < 4; tries++){
+    uint s = __atomic_load_n(&dcache.seq, __ATOMIC_ACQUIRE);
+    if(s & 1)
+      continue;
+    d = dfind(dev, pinum, name);
+    uint i = d ? d->inum : 0;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&dcache.seq, __ATOMIC_RELAXED) != s)
+      continue;
+    if(d == 0)
+      break;
+    __atomic_fetch_add(&dcache.hits, 1, __ATOMIC_RELAXED);
+    if(i == 0)
+      __atomic_fetch_add(&dcache.neghits, 1, __ATOMIC_RELAXED);
+    *inum = i;
+    *seq = s;
+    return 1;
+  }
+  __atomic_fetch_add(&dcache.misses, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// Is what dcache_lookup() returned with seq still true?
+int
+dcache_valid(uint seq)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&dcache.seq, __ATOMIC_RELAXED) == seq;
+}
+
+static void
+wbegin(void)
+{
+  acquire(&dcache.lock);
+  __atomic_store_n(&dcache.seq, dcache.seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+wend(void)
+{
+  __atomic_store_n(&dcache.seq, dcache.seq + 1, __ATOMIC_RELEASE);
+  release(&dcache.lock);
+}
+
+// Record that name in directory dp is inum (0 if none).
+// Caller must hold dp->lock.
+void
+dcache_enter(struct inode *dp, char *name, uint inum)
+{
+  struct dentry *d;
+  uint h;
+
+  if(dp->type != T_DIR)
+    return;
+  wbegin();
+  if((d = dfind(dp->dev, dp->inum, name)) == 0){
+    h = dhash(dp->dev, dp->inum, name);
+    d = &dcache.ent[h][dcache.hand[h]];
+    dcache.hand[h] = (dcache.hand[h] + 1) % NDWAY;
+    d->dev = dp->dev;
+    d->pinum = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+  }
+  d->inum = inum;
+  wend();
+}
+
+// Drop the entries of directory (dev, pinum), which is being freed.
+void
+dcache_purge(uint dev, uint pinum)
+{
+  wbegin();
+  for(int h = 0; h < NDHASH; h++)
+    for(int i = 0; i < NDWAY; i++)
+      if(dcache.ent[h][i].pinum == pinum && dcache.ent[h][i].dev == dev)
+        dcache.ent[h][i].pinum = 0;
+  wend();
+}
+
+int
+statsdcache(char *buf, int sz)
+{
+  return snprintf(buf, sz, "--- dcache: hits %d (negative %d) misses %d\n",
+                  (int)dcache.hits, (int)dcache.neghits, (int)dcache.misses);
+}
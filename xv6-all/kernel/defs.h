@@ -19,8 +19,16 @@ struct ip;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bread_class(uint, uint, int);
+struct buf*     bread_zero(uint, uint, int);
+uchar*          bexchange(struct buf*, uchar*);
+int             bread_multi(uint, uint, int, struct buf**, int);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwrite_multi(struct buf**, int);
+int             bprefetch(uint, uint, int);
+void            biodone(struct buf*);
+uint64          bra_wasted(void);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 void            bunpin2(uint64);
@@ -36,6 +44,7 @@ int             exec(char*, char**);
 // file.c
 struct file*    filealloc(void);
 void            fileclose(struct file*);
+int             fdgrow(struct proc*, int);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
@@ -46,6 +55,7 @@ int             filewrite(struct file*, uint64, int n);
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
+void            dirunlink(struct inode*, uint);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit();
@@ -58,11 +68,23 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+int             iprefetch(struct inode*, uint, int);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
+int             writei_nlog(uint);
+int             wbwrite(struct inode*, int, uint64, uint, uint);
+int             wbflush(struct inode*);
+void            wbflushall(void);
 void            itrunc(struct inode*);
 uint64          readblock(struct inode *ip, uint off);
 
+// dcache.c
+void            dcacheinit(void);
+int             dcache_lookup(uint, uint, char*, uint*, uint*);
+int             dcache_valid(uint);
+void            dcache_enter(struct inode*, char*, uint);
+void            dcache_purge(uint, uint);
+
 // ramdisk.c
 void            ramdiskinit(void);
 void            ramdiskintr(void);
@@ -70,20 +92,36 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
-void*           kalloc_cow(pte_t *);
+void*           kalloc_noswap(void);
+void*           kalloc_zeroed(void);
+void            kzero_idle(void);
+void            kzeroinfo(uint64*, uint64*, uint64*);
 void            kfree(void *);
 void*           kalloc_suppage(void);
 void            kfree_suppage(void *);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+int             kis_suppage(uint64);
 void            kinit(void);
 int             kincget(void *);
 uint            saved_page(int);
 uint64          saved_byte(int);
 int             kcollect(void);
+int             kfreepages(void);
+int             krefcnt(uint64);
+void            rmap_add(pagetable_t, pte_t *);
+void            rmap_remove(pte_t *);
+int             rmap_pin(uint64);
+int             rmap_referenced(uint64);
+int             rmap_swapout(uint64, int, int, pagetable_t*, int*);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
+void            begin_opn(int);
+int             log_maxop(void);
+void            log_force(void);
 void            end_op(void);
 
 // pipe.c
@@ -104,6 +142,7 @@ int             fork(void);
 int             clone(void(*)(void*, void*), void *, void *, void *);
 int             join(void **);
 int             growproc(int);
+int             kthread_create(void (*)(void), char*);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -126,13 +165,15 @@ void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
-uint64          find_swapping_page(int *, struct spinlock *);
-void            update_page_age(void);
+int             pagetable_pinned(pagetable_t);
+struct spinlock* pagetable_tlock(pagetable_t);
+void            tlb_shootdown(pagetable_t*, int);
 int             proc_number(void);
 void            calculate_load_1m(void);
 float           get_avgload_1m(void);
 struct proc*    get_proc_by_idx(int idx);
 struct proc*    get_proc_by_pid(int pid);
+int             threaded(struct proc*);
 
 // procfs.c
 void            procfsinit(void);
@@ -151,19 +192,31 @@ void            vma_exec_clear(struct proc *p);
 void            vma_fork(struct proc *p, struct proc *np);
 
 // swap.c
-uint64 pageout(pte_t *pte);
-int pagein(pte_t *pte, struct sleeplock *slock);
-uint8 pageage(pte_t *pte);
+int pagein(pagetable_t pagetable, uint64 va, struct spinlock *tlock);
 void initswap(int dev, struct superblock *sb);
-int swappageclone(pte_t *pte, pagetable_t new, int va);
+int swappageclone(pte_t pte, pagetable_t new, uint64 va);
+void swapincget(int idx);
 int swapdecget(int idx);
 int swapcollect(void);
+int reclaim(int n);
+int reclaim_oldest(void);
+
+// zswap.c
+void            zswapinit(int);
+int             zstore(int, uint64);
+int             zhas(int);
+int             zload(int, uint64);
+void            zdrop(int);
+int             zspill(int, uint64);
+void            zspilled(int);
+void            zswapinfo(uint64*, uint64*, uint64*, uint64*, uint64*);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
 
 // spinlock.c
 void            acquire(struct spinlock*);
+int             tryacquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
@@ -219,7 +272,7 @@ pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, struct spinlock*);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -229,6 +282,7 @@ pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyonwrite(pte_t *);
 int             copyout(pagetable_t, uint64, char *, uint64);
+int             copyout_buf(struct proc*, uint64, struct buf*);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 void            vmprint(pagetable_t);
@@ -243,6 +297,9 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_submit(struct buf *, int);
+void            virtio_disk_submitv(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // debugtbl.c
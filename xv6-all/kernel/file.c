@@ -13,16 +13,76 @@
 #include "stat.h"
 #include "proc.h"
 
+#define RAMIN 4                                 // initial read-ahead window
+#define RAMAX (NBUF/4 < 32 ? NBUF/4 : 32)       // largest read-ahead window
+
 struct devsw devsw[NDEV];
+
+// File structures are carved out of pages, which are never
+// given back. Each CPU keeps its own list of free ones; a CPU
+// whose list is empty steals half of another's, and a new page
+// is only allocated when no CPU has a free file. A file's ref
+// is changed atomically, without a lock.
+#define FPP (PGSIZE / sizeof(struct file))  // files per page
+
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
-} ftable;
+  struct file *freelist;
+  char name[20];
+} ftables[NCPU];
+
+// Put the files f[0..n-1] on this CPU's free list.
+static void
+ffree(struct file *f, int n)
+{
+  push_off();
+  int i = cpuid();
+
+  acquire(&ftables[i].lock);
+  for(int j = 0; j < n; j++){
+    f[j].next = ftables[i].freelist;
+    ftables[i].freelist = &f[j];
+  }
+  release(&ftables[i].lock);
+  pop_off();
+}
+
+// Give the free files of a new page to this CPU.
+static int
+fgrow(void)
+{
+  struct file *f;
+
+  if((f = kalloc()) == 0)
+    return -1;
+  memset(f, 0, PGSIZE);
+  ffree(f, FPP);
+  return 0;
+}
 
 void
 fileinit(void)
 {
-  initlock(&ftable.lock, "ftable");
+  for (int i = 0; i < NCPU; i++) {
+    snprintf(ftables[i].name, 20, "ftable-%d", i);
+    initlock(&ftables[i].lock, ftables[i].name);
+  }
+  if(fgrow() < 0)
+    panic("fileinit");
+}
+
+// Split the list at head in two; return the second half.
+static struct file *
+fsteal(struct file *head)
+{
+  struct file *slow = head, *fast = head->next;
+  while (fast && fast->next) {
+    slow = slow->next;
+    fast = fast->next->next;
+  }
+  fast = slow->next;
+  slow->next = 0;
+  return fast;
 }
 
 // Allocate a file structure.
@@ -31,27 +91,46 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
+  do {
+    push_off();
+    int i = cpuid();
+
+    acquire(&ftables[i].lock);
+    f = ftables[i].freelist;
+    if(f)
+      ftables[i].freelist = f->next;
+    release(&ftables[i].lock);
+    for (int j = 0; j < NCPU && !f; j++) {
+      if (j == i) continue;
+      acquire(&ftables[j].lock);
+      if (ftables[j].freelist) {
+        f = ftables[j].freelist;
+        ftables[j].freelist = fsteal(ftables[j].freelist);
+      }
+      release(&ftables[j].lock);
+      if (f && f->next) {
+        acquire(&ftables[i].lock);
+        ftables[i].freelist = f->next;
+        release(&ftables[i].lock);
+      }
     }
+    pop_off();
+  } while(f == 0 && fgrow() == 0);
+
+  if(f){
+    f->ref = 1;
+    f->ra_off = 0;
+    f->ra_win = 0;
   }
-  release(&ftable.lock);
-  return 0;
+  return f;
 }
 
 // Increment ref count for file f.
 struct file*
 filedup(struct file *f)
 {
-  acquire(&ftable.lock);
-  if(f->ref < 1)
+  if(__atomic_fetch_add(&f->ref, 1, __ATOMIC_RELAXED) < 1)
     panic("filedup");
-  f->ref++;
-  release(&ftable.lock);
   return f;
 }
 
@@ -60,18 +139,15 @@ void
 fileclose(struct file *f)
 {
   struct file ff;
+  int ref;
 
-  acquire(&ftable.lock);
-  if(f->ref < 1)
+  if((ref = __atomic_sub_fetch(&f->ref, 1, __ATOMIC_ACQ_REL)) < 0)
     panic("fileclose");
-  if(--f->ref > 0){
-    release(&ftable.lock);
+  if(ref > 0)
     return;
-  }
   ff = *f;
-  f->ref = 0;
   f->type = FD_NONE;
-  release(&ftable.lock);
+  ffree(f, 1);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -84,6 +160,26 @@ fileclose(struct file *f)
   }
 }
 
+// Make p's table of open files hold at least n of them.
+// Returns -1 if n is too many or there is no memory.
+int
+fdgrow(struct proc *p, int n)
+{
+  struct file **t;
+
+  if(n <= p->nofile)
+    return 0;
+  if(n > MAXOFILE || (t = kalloc()) == 0)
+    return -1;
+  memset(t, 0, PGSIZE);
+  memmove(t, p->ofile, p->nofile * sizeof(*t));
+  if(p->nofile > NOFILE)
+    kfree((void*)p->ofile);
+  p->ofile = t;
+  p->nofile = MAXOFILE;
+  return 0;
+}
+
 // Get metadata about file f.
 // addr is a user virtual address, pointing to a struct stat.
 int
@@ -103,6 +199,45 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Called after a read of n bytes at off from f. If f is being
+// read sequentially, start reading the blocks after off+n into
+// the buffer cache. The window doubles each time the reader
+// catches up with it, and halves when read-ahead blocks were
+// evicted before being used. Caller must hold f->ip->lock.
+static void
+readahead(struct file *f, uint off, int n)
+{
+  uint cur = (off + n) / BSIZE;
+  uint64 wasted = bra_wasted();
+
+  if(off != f->ra_off){
+    // not sequential: stop reading ahead until it is again.
+    f->ra_off = off + n;
+    f->ra_win = 0;
+    return;
+  }
+  f->ra_off = off + n;
+
+  if(f->ra_win == 0){
+    f->ra_win = RAMIN;
+    f->ra_next = cur;
+  } else if(wasted != f->ra_wasted){
+    f->ra_win = f->ra_win / 2 < RAMIN ? RAMIN : f->ra_win / 2;
+  } else if(f->ra_next <= cur && f->ra_win < RAMAX){
+    f->ra_win = f->ra_win * 2 > RAMAX ? RAMAX : f->ra_win * 2;
+  }
+  f->ra_wasted = wasted;
+
+  if(f->ra_next < cur)
+    f->ra_next = cur;
+  // wait until half the window has been consumed, so that
+  // each prefetch covers a worthwhile run of blocks.
+  if(f->ra_next - cur > f->ra_win / 2)
+    return;
+  iprefetch(f->ip, f->ra_next, cur + f->ra_win - f->ra_next);
+  f->ra_next = cur + f->ra_win;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -122,8 +257,10 @@ fileread(struct file *f, uint64 addr, int n)
       f->off += r;
   } else if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    if((r = readi(f->ip, 1, addr, f->off, n)) > 0){
+      readahead(f, f->off, r);
       f->off += r;
+    }
     iunlock(f->ip);
   } else if(f->type == FD_SOCK){
     r = sockread(f->sock, addr, n);
@@ -151,21 +288,42 @@ filewrite(struct file *f, uint64 addr, int n)
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
+  } else if(f->type == FD_INODE && f->wrback){
+    // no transaction: the data waits in dirty pages. if too
+    // much is dirty, help the flusher write it out.
+    int i = 0, stuck = 0;
+    while(i < n){
+      ilock(f->ip);
+      if((r = wbwrite(f->ip, 1, addr + i, f->off, n - i)) > 0)
+        f->off += r;
+      iunlock(f->ip);
+      // give up if a flush did not make room (no memory for a page).
+      if(r < 0 || (r == 0 && stuck++))
+        break;
+      if(r > 0)
+        stuck = 0;
+      i += r;
+      if(i < n)
+        wbflushall();
+    }
+    ret = (i == n ? n : -1);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write as many blocks at a time as fit in the
+    // maximum log transaction size, and reserve only the
+    // log space each piece can use, so that small writes
+    // can share a transaction.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = log_maxop() * BSIZE;
+    while(max > BSIZE && writei_nlog(max) > log_maxop())
+      max -= BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      begin_opn(writei_nlog(n1));
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
@@ -1,13 +1,21 @@
 struct file {
   enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE, FD_SOCK } type;
   int ref; // reference count
+  struct file *next; // free list
   char readable;
   char writable;
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   struct sock *sock; // FD_SOCK
   uint off;          // FD_INODE
+  char wrback;       // FD_INODE opened with O_WRBACK
   short major;       // FD_DEVICE
+
+  // sequential read-ahead state, FD_INODE
+  uint ra_off;       // where the next sequential read would start
+  uint ra_next;      // first block not yet read ahead
+  int ra_win;        // read-ahead window in blocks; 0 if not sequential
+  uint64 ra_wasted;  // bra_wasted() when the window was last sized
 };
 
 #define major(dev)  ((dev) >> 16 & 0xFFFF)
@@ -19,6 +27,10 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext;   // itable hash chain
+  struct inode *lnext;   // itable LRU list, if ref is 0
+  struct inode *lprev;
+  struct inode *wbnext;  // list of inodes with dirty pages
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -27,7 +39,17 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[TOTBUF];
+  uint flags;
+  union {
+    uint addrs[TOTBUF];
+    struct extent ext[NEXTENT];
+  };
+  uint extblk;
+
+  // O_WRBACK data not yet on disk; see wbwrite().
+  struct wbpage *dirty;  // sorted by block number
+  int ndirty;
+  uint wbsize;        // size including the dirty pages
 };
 
 // map major device number to device functions.
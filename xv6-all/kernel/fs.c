@@ -20,19 +20,39 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "memlayout.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+// buffer cache class of ip's data blocks.
+#define ICLASS(ip) ((ip)->type == T_DIR ? BC_DIR : BC_DATA)
+// size of ip as read() sees it, with its dirty write-back pages.
+#define ISIZE(ip) ((ip)->ndirty ? (ip)->wbsize : (ip)->size)
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
 
+static void fmapinit(int);
+
+// a dirty page of a file being written back; see wbwrite().
+struct wbpage {
+  uint bn;             // block number in the file
+  char *data;
+  struct wbpage *next;
+};
+
+static void wbinit(void);
+static struct wbpage* wbfind(struct inode*, uint);
+static int wbwrite1(struct inode*, int, uint64, uint, uint, int);
+static int iwrite(struct inode*, int, uint64, uint, uint);
+static void wbdiscard(struct inode*);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
 {
   struct buf *bp;
 
-  bp = bread(dev, 1);
+  bp = bread_class(dev, 1, BC_META);
   memmove(sb, bp->data, sizeof(*sb));
   brelse(bp);
 }
@@ -44,6 +64,8 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  fmapinit(dev);
+  wbinit();
   initswap(dev, &sb);
 }
 
@@ -60,32 +82,148 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// The kernel keeps a copy of the free bitmap in memory, loaded
+// by fmapinit() and changed together with the logged bitmap by
+// balloc() and bfree(). It is divided into allocation groups of
+// AGBLOCKS blocks, each with its own lock, free count and hint
+// of where its first free block may be, so that finding a free
+// block does not read the disk and rarely scans far. Each CPU
+// allocates new files from its own group, which keeps files
+// written at the same time on different CPUs apart.
+
+#define AGBLOCKS 4096   // blocks per allocation group
+#define NAGROUP   256   // max allocation groups
+#define AGPP (PGSIZE / (AGBLOCKS / 8))  // groups' maps per page
+
+struct agroup {
+  struct spinlock lock;
+  uchar *map;   // bit per block, set if in use
+  uint nfree;
+  uint hint;    // no free block before this one
+};
+
+struct {
+  int n;
+  struct agroup ag[NAGROUP];
+  uint cursor[NCPU];  // where each CPU allocates when it has no goal
+} fmap;
+
+// Load the free bitmap of dev into memory.
+static void
+fmapinit(int dev)
+{
+  struct buf *bp = 0;
+  uint b;
+
+  fmap.n = (sb.size + AGBLOCKS - 1) / AGBLOCKS;
+  if(fmap.n > NAGROUP)
+    panic("fmapinit: too many blocks");
+  for(int g = 0; g < fmap.n; g++){
+    struct agroup *ag = &fmap.ag[g];
+    initlock(&ag->lock, "agroup");
+    if(g % AGPP == 0 && (ag->map = kalloc()) == 0)
+      panic("fmapinit: kalloc");
+    if(g % AGPP)
+      ag->map = fmap.ag[g-1].map + AGBLOCKS / 8;
+    memset(ag->map, 0xff, AGBLOCKS / 8);  // past the end is in use
+    ag->hint = g * AGBLOCKS;
+  }
+  for(b = 0; b < sb.size; b++){
+    if(b % BPB == 0){
+      if(bp)
+        brelse(bp);
+      bp = bread_class(dev, BBLOCK(b, sb), BC_BITMAP);
+    }
+    struct agroup *ag = &fmap.ag[b / AGBLOCKS];
+    uint bi = b % BPB, gi = b % AGBLOCKS;
+    if((bp->data[bi/8] & (1 << (bi % 8))) == 0){
+      ag->map[gi/8] &= ~(1 << (gi % 8));
+      ag->nfree++;
+    }
+  }
+  brelse(bp);
+  for(int c = 0; c < NCPU; c++)
+    fmap.cursor[c] = (c * fmap.n / NCPU) * AGBLOCKS;
+}
 
-// Allocate a zeroed disk block.
+// Take the first free block of group g at or after from,
+// or return 0.
+static uint
+agtake(int g, uint from)
+{
+  struct agroup *ag = &fmap.ag[g];
+  uint b = 0, end = (g + 1) * AGBLOCKS;
+
+  acquire(&ag->lock);
+  if(from < ag->hint)
+    from = ag->hint;
+  for(uint x = from; ag->nfree > 0 && x < end; x++){
+    uint gi = x % AGBLOCKS;
+    if(ag->map[gi/8] == 0xff){   // skip a full byte
+      x |= 7;
+      continue;
+    }
+    if((ag->map[gi/8] & (1 << (gi % 8))) == 0){
+      ag->map[gi/8] |= 1 << (gi % 8);
+      ag->nfree--;
+      b = x;
+      break;
+    }
+  }
+  if(from == ag->hint)
+    ag->hint = b ? b + 1 : end;
+  release(&ag->lock);
+  return b;
+}
+
+// Allocate a disk block: goal if it is free, else the first
+// free block after it in its group, so that a file grows
+// contiguously. With no goal, or none near it, continue from
+// this CPU's cursor. The block is zeroed on disk if zero is
+// set; otherwise it is zeroed only in the buffer cache, and the
+// caller must overwrite all of it.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint goal, int zero)
 {
-  int b, bi, m;
   struct buf *bp;
-
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  uint b = 0, *cursor;
+  int g, bi, m;
+
+  if(goal > 0 && goal < sb.size)
+    b = agtake(goal / AGBLOCKS, goal);
+  if(b == 0){
+    push_off();
+    cursor = &fmap.cursor[cpuid()];
+    pop_off();
+    g = *cursor / AGBLOCKS;
+    // the cursor's group from the cursor on, the other groups,
+    // and then the cursor's group again from its start.
+    for(int i = 0; i <= fmap.n && b == 0; i++){
+      int gg = (g + i) % fmap.n;
+      b = agtake(gg, i == 0 ? *cursor : gg * AGBLOCKS);
     }
-    brelse(bp);
+    if(b == 0){
+      printf("balloc: out of blocks\n");
+      return 0;
+    }
+    *cursor = b + 1;
   }
-  printf("balloc: out of blocks\n");
-  return 0;
+
+  bp = bread_class(dev, BBLOCK(b, sb), BC_BITMAP);
+  bi = b % BPB;
+  m = 1 << (bi % 8);
+  if(bp->data[bi/8] & m)
+    panic("balloc: bitmap");
+  bp->data[bi/8] |= m;  // Mark block in use.
+  log_write(bp);
+  brelse(bp);
+  if(zero)
+    bzero(dev, b);
+  else
+    brelse(bread_zero(dev, b, BC_DATA));
+  return b;
 }
 
 // Free a disk block.
@@ -95,7 +233,7 @@ bfree(int dev, uint b)
   struct buf *bp;
   int bi, m;
 
-  bp = bread(dev, BBLOCK(b, sb));
+  bp = bread_class(dev, BBLOCK(b, sb), BC_BITMAP);
   bi = b % BPB;
   m = 1 << (bi % 8);
   if((bp->data[bi/8] & m) == 0)
@@ -103,6 +241,15 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+
+  // only now may balloc() hand it out again.
+  struct agroup *ag = &fmap.ag[b / AGBLOCKS];
+  acquire(&ag->lock);
+  ag->map[(b % AGBLOCKS)/8] &= ~(1 << (b % 8));
+  ag->nfree++;
+  if(b < ag->hint)
+    ag->hint = b;
+  release(&ag->lock);
 }
 
 // Inodes.
@@ -130,18 +277,19 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to the entry (open files and current
+//   directories). iget() finds or creates a table entry and
+//   increments its ref; iput() decrements ref. An entry whose
+//   ref is zero stays in the table, still valid, on an LRU
+//   list, and is only recycled for another inode when iget()
+//   finds no free entry.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid if it frees the inode.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -165,28 +313,83 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The table is hashed on (dev, inum). The lock of an entry's
+// hash bucket protects its ip->ref, ip->dev, ip->inum and
+// ip->hnext, so one must hold it while using any of those
+// fields. itable.lrulock protects the LRU list of entries whose
+// ref is zero; it is acquired after a bucket lock, never before.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum, and the list links.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
-struct {
+#define NIHASH 61
+
+struct ibucket {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *head;
+};
+
+struct {
+  struct ibucket bucket[NIHASH];
+  struct spinlock lrulock;
+  struct inode lru;   // lru.lnext is the least recently used
+  int n;
 } itable;
 
+static struct ibucket*
+ibucket(uint dev, uint inum)
+{
+  return &itable.bucket[(dev * 31 + inum) % NIHASH];
+}
+
+// Put unreferenced ip on the LRU list: at the recently used
+// end, or at the other end if it holds no inode.
+// Caller must hold itable.lrulock.
+static void
+lru_add(struct inode *ip, int cold)
+{
+  struct inode *at = cold ? &itable.lru : itable.lru.lprev;
+
+  ip->lnext = at->lnext;
+  ip->lprev = at;
+  at->lnext->lprev = ip;
+  at->lnext = ip;
+}
+
+static void
+lru_del(struct inode *ip)
+{
+  ip->lprev->lnext = ip->lnext;
+  ip->lnext->lprev = ip->lprev;
+  ip->lnext = ip->lprev = 0;
+}
+
+// Size the table from the amount of memory: an entry
+// for every 256 pages, but at least NINODE.
 void
 iinit()
 {
-  int i = 0;
-  
-  initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  extern char end[];
+  int n = (PHYSTOP - (uint64)end) / PGSIZE / 256;
+  int per = PGSIZE / sizeof(struct inode);
+
+  if(n < NINODE)
+    n = NINODE;
+  for(int i = 0; i < NIHASH; i++)
+    initlock(&itable.bucket[i].lock, "itable");
+  initlock(&itable.lrulock, "itable");
+  itable.lru.lnext = itable.lru.lprev = &itable.lru;
+  while(itable.n < n){
+    struct inode *ip = kalloc();
+    if(ip == 0)
+      panic("iinit");
+    memset(ip, 0, PGSIZE);
+    for(int i = 0; i < per; i++, ip++){
+      initsleeplock(&ip->lock, "inode");
+      lru_add(ip, 1);
+    }
+    itable.n += per;
   }
 }
 
@@ -204,11 +407,14 @@ ialloc(uint dev, short type)
   struct dinode *dip;
 
   for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
+    bp = bread_class(dev, IBLOCK(inum, sb), BC_INODE);
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
+      dip->flags = I_EXTENT;
+      if(type == T_DIR)
+        dip->flags |= I_HASHDIR;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
       return iget(dev, inum);
@@ -229,52 +435,124 @@ iupdate(struct inode *ip)
   struct buf *bp;
   struct dinode *dip;
 
-  bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+  bp = bread_class(ip->dev, IBLOCK(ip->inum, sb), BC_INODE);
   dip = (struct dinode*)bp->data + ip->inum%IPB;
   dip->type = ip->type;
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  dip->flags = ip->flags;
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
+  dip->extblk = ip->extblk;
   log_write(bp);
   brelse(bp);
 }
 
+// Look for (dev, inum) in bucket b and take a reference.
+// Caller must hold b->lock.
+static struct inode*
+ifind(struct ibucket *b, uint dev, uint inum)
+{
+  for(struct inode *ip = b->head; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0){
+        acquire(&itable.lrulock);
+        lru_del(ip);
+        release(&itable.lrulock);
+      }
+      return ip;
+    }
+  }
+  return 0;
+}
+
+// Take the least recently used unreferenced entry out of
+// the table, or return 0 if every entry is in use.
+static struct inode*
+ievict(void)
+{
+  struct inode *ip;
+  struct ibucket *b;
+
+  for(;;){
+    acquire(&itable.lrulock);
+    ip = itable.lru.lnext;
+    if(ip == &itable.lru){
+      release(&itable.lrulock);
+      return 0;
+    }
+    if(ip->inum == 0){
+      // never used: in no bucket.
+      lru_del(ip);
+      release(&itable.lrulock);
+      return ip;
+    }
+    b = ibucket(ip->dev, ip->inum);
+    release(&itable.lrulock);
+
+    // bucket locks come first; check that ip did not
+    // change while neither lock was held.
+    acquire(&b->lock);
+    acquire(&itable.lrulock);
+    if(ip->ref == 0 && ip->lnext && ibucket(ip->dev, ip->inum) == b){
+      lru_del(ip);
+      release(&itable.lrulock);
+      struct inode **pp = &b->head;
+      while(*pp != ip)
+        pp = &(*pp)->hnext;
+      *pp = ip->hnext;
+      ip->hnext = 0;
+      ip->inum = 0;
+      release(&b->lock);
+      return ip;
+    }
+    release(&itable.lrulock);
+    release(&b->lock);
+  }
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode*
 iget(uint dev, uint inum)
 {
+  struct ibucket *b = ibucket(dev, inum);
   struct inode *ip, *empty;
 
-  acquire(&itable.lock);
-
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
-  }
+  acquire(&b->lock);
+  ip = ifind(b, dev, inum);
+  release(&b->lock);
+  if(ip)
+    return ip;
 
   // Recycle an inode entry.
-  if(empty == 0)
+  if((empty = ievict()) == 0)
     panic("iget: no inodes");
 
+  acquire(&b->lock);
+  if((ip = ifind(b, dev, inum)) != 0){
+    // someone else added it meanwhile.
+    release(&b->lock);
+    acquire(&itable.lrulock);
+    lru_add(empty, 1);
+    release(&itable.lrulock);
+    return ip;
+  }
   ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
   // avoid conflict when inode reused by procfs
-  memset(ip->addrs, 0, sizeof(ip->addrs));
-  release(&itable.lock);
+  ip->flags = 0;
+  memset(ip->ext, 0, sizeof(ip->ext));
+  ip->extblk = 0;
+  ip->hnext = b->head;
+  b->head = ip;
+  release(&b->lock);
 
   return ip;
 }
@@ -284,9 +562,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *b = ibucket(ip->dev, ip->inum);
+
+  acquire(&b->lock);
   ip->ref++;
-  release(&itable.lock);
+  release(&b->lock);
   return ip;
 }
 
@@ -304,14 +584,16 @@ ilock(struct inode *ip)
   acquiresleep(&ip->lock);
   
   if(ip->valid == 0){
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+    bp = bread_class(ip->dev, IBLOCK(ip->inum, sb), BC_INODE);
     dip = (struct dinode*)bp->data + ip->inum%IPB;
     ip->type = dip->type;
     ip->major = dip->major;
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    ip->flags = dip->flags;
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    ip->extblk = dip->extblk;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -339,7 +621,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *b = ibucket(ip->dev, ip->inum);
+
+  acquire(&b->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -348,8 +632,10 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&b->lock);
 
+    if(ip->type == T_DIR)
+      dcache_purge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -357,11 +643,16 @@ iput(struct inode *ip)
 
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquire(&b->lock);
   }
 
-  ip->ref--;
-  release(&itable.lock);
+  if(--ip->ref == 0){
+    // keep it cached, unless it was just freed.
+    acquire(&itable.lrulock);
+    lru_add(ip, !ip->valid);
+    release(&itable.lrulock);
+  }
+  release(&b->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -378,19 +669,104 @@ iunlockput(struct inode *ip)
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
 // listed in block ip->addrs[NDIRECT].
+//
+// An inode with I_EXTENT set instead lists runs of blocks
+// (extents) in ip->ext[], in file order, continued when it is
+// full in a chain of extent blocks starting at ip->extblk.
+// Files have no holes, so the extent holding a block is found
+// by adding up lengths, and a file only grows at its end.
+
+// How bmap() allocates a missing data block.
+#define BM_ZERO 1   // zero it on disk
+#define BM_FILL 2   // the caller overwrites all of it
+
+// Return the disk block holding block bn of extent-mapped ip,
+// and set *run to the number of blocks from bn to the end of
+// its extent. If bn is the block just past the end of the file
+// and alloc is BM_ZERO or BM_FILL, allocate it, next to the last
+// one if that is free. Returns 0 if there is no such block.
+static uint
+emap(struct inode *ip, uint bn, int alloc, uint *run)
+{
+  struct extent *ext = ip->ext;
+  struct extblock *xb = 0;
+  struct buf *bp = 0, *nbp;
+  uint next = ip->extblk, base = 0, addr = 0, goal, nb;
+  int i, cap = NEXTENT;
+
+  for(;;){
+    for(i = 0; i < cap && ext[i].len; i++){
+      if(bn < base + ext[i].len){
+        *run = base + ext[i].len - bn;
+        addr = ext[i].start + bn - base;
+        goto out;
+      }
+      base += ext[i].len;
+    }
+    if(next == 0)
+      break;
+    if(bp)
+      brelse(bp);
+    bp = bread_class(ip->dev, next, BC_INDIRECT);
+    xb = (struct extblock*)bp->data;
+    ext = xb->ext;
+    cap = NEXTPB;
+    next = xb->next;
+  }
+
+  // ext[i] is the first unused slot of the last list.
+  if(!alloc || bn != base)
+    goto out;
+  goal = i > 0 ? ext[i-1].start + ext[i-1].len : 0;
+  if((addr = balloc(ip->dev, goal, alloc == BM_ZERO)) == 0)
+    goto out;
+  if(i > 0 && addr == goal){
+    ext[i-1].len++;
+  } else if(i < cap){
+    ext[i].start = addr;
+    ext[i].len = 1;
+  } else {
+    // the list is full; continue it in a new extent block.
+    if((nb = balloc(ip->dev, 0, 1)) == 0){
+      bfree(ip->dev, addr);
+      addr = 0;
+      goto out;
+    }
+    nbp = bread_class(ip->dev, nb, BC_INDIRECT);
+    ((struct extblock*)nbp->data)->ext[0].start = addr;
+    ((struct extblock*)nbp->data)->ext[0].len = 1;
+    log_write(nbp);
+    brelse(nbp);
+    if(xb)
+      xb->next = nb;
+    else
+      ip->extblk = nb;
+  }
+  if(bp)
+    log_write(bp);
+  *run = 1;
+out:
+  if(bp)
+    brelse(bp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one, zeroed
+// or not as how (BM_ZERO or BM_FILL) says.
 // returns 0 if out of disk space.
 static uint
-bmap(struct inode *ip, uint bn)
+bmap(struct inode *ip, uint bn, int how)
 {
   uint addr, *a;
   struct buf *bp;
 
+  if(ip->flags & I_EXTENT)
+    return emap(ip, bn, how, &addr);
+
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, 0, how == BM_ZERO);
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
@@ -404,15 +780,15 @@ bmap(struct inode *ip, uint bn)
     if (bn < base) {
       uint idx = NDIRECT + in_layer;
       if((addr = ip->addrs[idx]) == 0){
-        if ((ip->addrs[idx] = addr = balloc(ip->dev)) == 0)
+        if ((ip->addrs[idx] = addr = balloc(ip->dev, 0, 1)) == 0)
           return 0;
       }
       for (int j = 0; j <= in_layer; j++, bn %= prev_base, prev_base /= NINDIRECT) {
-        bp = bread(ip->dev, addr);
+        bp = bread_class(ip->dev, addr, BC_INDIRECT);
         a = (uint*)bp->data;
         idx = bn / prev_base;
         if((addr = a[idx]) == 0){
-          if((addr = balloc(ip->dev))){
+          if((addr = balloc(ip->dev, 0, j < in_layer || how == BM_ZERO))){
             a[idx] = addr;
             log_write(bp);
           }
@@ -427,6 +803,73 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// Like bmap, but never allocates: return 0 if
+// the nth block of ip has not been allocated.
+// Sets *run to the number of blocks from the nth on that
+// are known to follow it on disk.
+static uint
+bmap_run(struct inode *ip, uint bn, uint *run)
+{
+  uint addr;
+  struct buf *bp;
+
+  if(ip->flags & I_EXTENT)
+    return emap(ip, bn, 0, run);
+
+  *run = 1;
+  if(bn < NDIRECT)
+    return ip->addrs[bn];
+  bn -= NDIRECT;
+
+  uint prev_base = 1;
+  for (int in_layer = 0, base = NINDIRECT; in_layer < INDIR_LAYERS; in_layer++, base *= NINDIRECT) {
+    if (bn < base) {
+      addr = ip->addrs[NDIRECT + in_layer];
+      for (int j = 0; j <= in_layer && addr; j++, bn %= prev_base, prev_base /= NINDIRECT) {
+        bp = bread_class(ip->dev, addr, BC_INDIRECT);
+        addr = ((uint*)bp->data)[bn / prev_base];
+        brelse(bp);
+      }
+      return addr;
+    }
+    bn -= base;
+    prev_base = base;
+  }
+  return 0;
+}
+
+// Start asynchronous reads of file blocks [bn, bn+n) of ip
+// into the buffer cache, stopping at the end of the file.
+// Caller must hold ip->lock.
+// Returns the number of disk blocks requested.
+int
+iprefetch(struct inode *ip, uint bn, int n)
+{
+  uint end = min(bn + n, (ip->size + BSIZE - 1) / BSIZE);
+  uint start = 0, len = 0;
+  int tot = 0;
+
+  // group the blocks into runs that are consecutive on disk.
+  for(uint b = bn, r; b < end; b += r){
+    uint addr = bmap_run(ip, b, &r);
+    if(r > end - b)
+      r = end - b;
+    if(addr == 0)
+      r = 1;
+    else if(len > 0 && addr == start + len){
+      len += r;
+      continue;
+    }
+    if(len > 0)
+      tot += bprefetch(ip->dev, start, len);
+    start = addr;
+    len = addr ? r : 0;
+  }
+  if(len > 0)
+    tot += bprefetch(ip->dev, start, len);
+  return tot;
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void 
@@ -435,7 +878,7 @@ turnc_recur(uint dev, uint *addr, int layer)
   struct buf *bp;
   uint *a;
 
-  bp = bread(dev, *addr);
+  bp = bread_class(dev, *addr, BC_INDIRECT);
   a = (uint*)bp->data;
   int last_layer = (layer == 0);
   for(int j = 0; j < NINDIRECT; j++){
@@ -447,9 +890,45 @@ turnc_recur(uint dev, uint *addr, int layer)
   bfree(dev, *addr);
   *addr = 0;
 }
+// Free the blocks of extent-mapped ip.
+static void
+etrunc(struct inode *ip)
+{
+  struct extent *ext = ip->ext;
+  struct buf *bp = 0;
+  uint next = ip->extblk, cur = 0;
+  int cap = NEXTENT;
+
+  for(;;){
+    for(int i = 0; i < cap && ext[i].len; i++){
+      for(uint b = 0; b < ext[i].len; b++)
+        bfree(ip->dev, ext[i].start + b);
+    }
+    if(bp){
+      brelse(bp);
+      bfree(ip->dev, cur);
+    }
+    if(next == 0)
+      break;
+    bp = bread_class(ip->dev, cur = next, BC_INDIRECT);
+    ext = ((struct extblock*)bp->data)->ext;
+    cap = NEXTPB;
+    next = ((struct extblock*)bp->data)->next;
+  }
+  memset(ip->ext, 0, sizeof(ip->ext));
+  ip->extblk = 0;
+}
+
 void
 itrunc(struct inode *ip)
 {
+  wbdiscard(ip);
+  if(ip->flags & I_EXTENT){
+    etrunc(ip);
+    ip->size = 0;
+    iupdate(ip);
+    return;
+  }
   for(int i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -476,7 +955,7 @@ stati(struct inode *ip, struct stat *st)
   st->ino = ip->inum;
   st->type = ip->type;
   st->nlink = ip->nlink;
-  st->size = ip->size;
+  st->size = ISIZE(ip);
   st->dev_dir = IS_DEV_DIR(ip);
 }
 
@@ -487,26 +966,61 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
+  uint tot, m, size = ISIZE(ip);
+  struct buf *bs[NBRUN];
+  struct wbpage *pg;
+  int i, nb;
 
-  if(off > ip->size || off + n < off)
+  if(off > size || off + n < off)
     return 0;
-  if(off + n > ip->size)
-    n = ip->size - off;
-
-  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
+  if(off + n > size)
+    n = size - off;
+  // whole blocks of a file read into whole user pages may be
+  // moved there without copying; see copyout_buf().
+  int zc = user_dst && ip->type == T_FILE && n >= BSIZE && BSIZE == PGSIZE;
+
+  for(tot=0; tot<n; ){
+    uint bn = off/BSIZE, run, r;
+    if(ip->ndirty && (pg = wbfind(ip, bn)) != 0){
+      m = min(n - tot, BSIZE - off%BSIZE);
+      if(either_copyout(user_dst, dst, pg->data + (off % BSIZE), m) == -1){
+        tot = -1;
+        break;
+      }
+      tot += m;
+      off += m;
+      dst += m;
+      continue;
+    }
+    uint addr = bmap_run(ip, bn, &run);
     if(addr == 0)
       break;
-    bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
-      brelse(bp);
-      tot = -1;
-      break;
+    // find how many of the remaining blocks follow addr on disk,
+    // and fetch them with a single request.
+    uint last = (off + n - tot - 1) / BSIZE;
+    for(nb = run; nb < NBRUN && bn + nb <= last; nb += r)
+      if(bmap_run(ip, bn + nb, &r) != addr + nb)
+        break;
+    nb = min(nb, min(NBRUN, last - bn + 1));
+    if(ip->ndirty)
+      nb = 1;  // the next blocks may be dirty
+    nb = bread_multi(ip->dev, addr, nb, bs, ICLASS(ip));
+    for(i = 0; i < nb; i++){
+      m = min(n - tot, BSIZE - off%BSIZE);
+      if(zc && m == BSIZE && copyout_buf(myproc(), dst, bs[i]) == 0)
+        ;
+      else if(either_copyout(user_dst, dst, bs[i]->data + (off % BSIZE), m) == -1) {
+        tot = -1;
+        break;
+      }
+      tot += m;
+      off += m;
+      dst += m;
     }
-    brelse(bp);
+    for(int j = 0; j < nb; j++)
+      brelse(bs[j]);
+    if(i < nb)
+      break;
   }
   return tot;
 }
@@ -518,7 +1032,7 @@ readblock(struct inode *ip, uint off)
   if(off >= ip->size)
     return 0;
   struct buf *bp;
-  uint addr = bmap(ip, off/BSIZE);
+  uint addr = bmap(ip, off/BSIZE, BM_ZERO);
   bp = bread(ip->dev, addr);
   bpin(bp);
   brelse(bp);
@@ -534,6 +1048,17 @@ readblock(struct inode *ip, uint off)
 // there was an error of some kind.
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
+{
+  // once some of the file waits in dirty pages, later writes must
+  // wait there too, or the flusher would overwrite them.
+  if(ip->ndirty)
+    return wbwrite1(ip, user_src, src, off, n, NWBPAGE);
+  return iwrite(ip, user_src, src, off, n);
+}
+
+// Write data to inode's disk blocks, through the log.
+static int
+iwrite(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
@@ -544,11 +1069,12 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    uint addr = bmap(ip, off/BSIZE);
+    m = min(n - tot, BSIZE - off%BSIZE);
+    // a block that is about to be filled need not be zeroed first.
+    uint addr = bmap(ip, off/BSIZE, m == BSIZE ? BM_FILL : BM_ZERO);
     if(addr == 0)
       break;
-    bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
+    bp = bread_class(ip->dev, addr, ICLASS(ip));
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
       break;
@@ -568,6 +1094,326 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   return tot;
 }
 
+// Upper bound on the number of blocks that writei() of n bytes
+// logs, wherever the write starts: the data blocks, the
+// indirect or extent blocks that map them, bitmap blocks for any of those
+// it allocates, and the inode.
+int
+writei_nlog(uint n)
+{
+  int nb = (n + BSIZE - 1) / BSIZE + 1;
+  int nind = nb / NINDIRECT + 3;
+  int nbitmap = sb.size / BPB + 1;
+
+  if(nbitmap > nb + nind)
+    nbitmap = nb + nind;
+  return nb + nind + nbitmap + 1;
+}
+
+// Write-back.
+//
+// A file opened with O_WRBACK does not log its writes: wbwrite()
+// copies them into dirty pages kept with the inode, without
+// allocating disk blocks, and the flusher thread later writes
+// each inode's dirty pages with as few transactions as the log
+// allows. So blocks are allocated together, next to each other,
+// and a stream of small writes costs a few large commits instead
+// of one commit each. readi() and stati() see the dirty pages;
+// fsync() writes them at once.
+//
+// ip->size stays the size on disk and ip->wbsize is the size with
+// the dirty pages. Every block past ip->size has a dirty page, so
+// writing them in block order never leaves a hole.
+//
+// An inode with dirty pages is on wb.inodes and that list holds a
+// reference to it. ip->dirty and ip->ndirty are protected by
+// ip->lock; wb.lock protects the rest.
+
+struct {
+  struct spinlock lock;
+  struct wbpage page[NWBPAGE];
+  struct wbpage *free;
+  int nused;
+  struct inode *inodes;   // inodes with dirty pages
+
+  uint64 written;         // pages flushed
+  uint64 commits;         // transactions that flushed them
+} wb;
+
+static void wbflusher(void);
+
+static void
+wbinit(void)
+{
+  initlock(&wb.lock, "wb");
+  for(int i = 0; i < NWBPAGE; i++){
+    wb.page[i].next = wb.free;
+    wb.free = &wb.page[i];
+  }
+  if(kthread_create(wbflusher, "flusher") < 0)
+    panic("wbinit: flusher");
+}
+
+static struct wbpage*
+wbfind(struct inode *ip, uint bn)
+{
+  struct wbpage *pg;
+
+  for(pg = ip->dirty; pg && pg->bn <= bn; pg = pg->next)
+    if(pg->bn == bn)
+      return pg;
+  return 0;
+}
+
+static void
+wbfree(struct wbpage *pg)
+{
+  kfree(pg->data);
+  acquire(&wb.lock);
+  pg->next = wb.free;
+  wb.free = pg;
+  wb.nused--;
+  release(&wb.lock);
+}
+
+// ip's last dirty page is gone: take it off wb.inodes. The
+// caller must iput() it once it has released ip->lock.
+static void
+wbclean(struct inode *ip)
+{
+  struct inode **pp;
+
+  acquire(&wb.lock);
+  for(pp = &wb.inodes; *pp != ip; pp = &(*pp)->wbnext)
+    ;
+  *pp = ip->wbnext;
+  release(&wb.lock);
+}
+
+// Return the dirty page for block bn of ip, making one holding
+// the block's current content if there is none and fewer than
+// limit pages are in use. Caller must hold ip->lock.
+static struct wbpage*
+wbget(struct inode *ip, uint bn, int limit)
+{
+  struct wbpage *pg, **pp;
+
+  if((pg = wbfind(ip, bn)) != 0)
+    return pg;
+
+  acquire(&wb.lock);
+  if(wb.nused >= limit || (pg = wb.free) == 0){
+    release(&wb.lock);
+    return 0;
+  }
+  wb.free = pg->next;
+  wb.nused++;
+  release(&wb.lock);
+  if((pg->data = kalloc()) == 0){
+    acquire(&wb.lock);
+    pg->next = wb.free;
+    wb.free = pg;
+    wb.nused--;
+    release(&wb.lock);
+    return 0;
+  }
+  pg->bn = bn;
+  memset(pg->data, 0, BSIZE);
+  if(bn * BSIZE < ISIZE(ip))
+    readi(ip, 0, (uint64)pg->data, bn * BSIZE, BSIZE);
+
+  if(ip->ndirty++ == 0){
+    ip->wbsize = ip->size;
+    idup(ip);
+    acquire(&wb.lock);
+    ip->wbnext = wb.inodes;
+    wb.inodes = ip;
+    release(&wb.lock);
+  }
+  for(pp = &ip->dirty; *pp && (*pp)->bn < bn; pp = &(*pp)->next)
+    ;
+  pg->next = *pp;
+  *pp = pg;
+  return pg;
+}
+
+// Write data to ip's dirty pages, using no more than limit pages
+// in all. Returns the number of bytes written, which is less than
+// n if the pages ran out, or -1 on error.
+// Caller must hold ip->lock.
+static int
+wbwrite1(struct inode *ip, int user_src, uint64 src, uint off, uint n, int limit)
+{
+  struct wbpage *pg;
+  uint tot, m;
+
+  if(off > ISIZE(ip) || off + n < off)
+    return -1;
+  if(off + n > MAXFILE*BSIZE)
+    return -1;
+
+  for(tot=0; tot<n; tot+=m, off+=m, src+=m){
+    m = min(n - tot, BSIZE - off%BSIZE);
+    if((pg = wbget(ip, off/BSIZE, limit)) == 0)
+      break;
+    if(either_copyin(pg->data + (off % BSIZE), user_src, src, m) == -1)
+      return -1;
+    if(off + m > ip->wbsize)
+      ip->wbsize = off + m;
+  }
+  return tot;
+}
+
+// Write data to inode, leaving it in dirty pages for the flusher.
+// Stops short when too much is dirty; the caller should then
+// wbflush() and write the rest.
+// Caller must hold ip->lock.
+int
+wbwrite(struct inode *ip, int user_src, uint64 src, uint off, uint n)
+{
+  // leave some pages for writei() to files that are already dirty.
+  return wbwrite1(ip, user_src, src, off, n, NWBPAGE / 2);
+}
+
+// Drop ip's dirty pages, because it is being truncated.
+// Caller must hold ip->lock, and a reference besides the one
+// wb.inodes holds.
+static void
+wbdiscard(struct inode *ip)
+{
+  struct wbpage *pg;
+
+  if(ip->ndirty == 0)
+    return;
+  while((pg = ip->dirty) != 0){
+    ip->dirty = pg->next;
+    wbfree(pg);
+  }
+  ip->ndirty = 0;
+  wbclean(ip);
+  iput(ip);
+}
+
+// Write the pages that are dirty in ip to disk, in block order,
+// as many as writei() can log in one transaction at a time.
+// A page that can't be written (the disk is full) stays dirty,
+// with those after it, and wbflush() returns -1. The pages of a
+// file that has been unlinked are dropped. Returns 0 once the
+// transactions are committed, though perhaps not yet durable.
+// Caller must hold a reference to ip but not ip->lock, and must
+// not be in a transaction.
+int
+wbflush(struct inode *ip)
+{
+  struct wbpage *pg;
+  int max, left = -1, dirty, clean, err = 0;
+
+  max = log_maxop() * BSIZE;
+  while(max > BSIZE && writei_nlog(max) > log_maxop())
+    max -= BSIZE;
+
+  while(left != 0 && !err){
+    begin_opn(writei_nlog(max));
+    ilock(ip);
+    if(ip->nlink == 0 && ip->ndirty > 0){
+      // nobody can open it again; don't write what itrunc() will free.
+      wbdiscard(ip);
+      iunlock(ip);
+      end_op();
+      return 0;
+    }
+    // pages dirtied while we flush are left for next time.
+    if(left < 0)
+      left = ip->ndirty;
+    dirty = ip->ndirty > 0;
+    for(int n = 0; left > 0 && (pg = ip->dirty) != 0 && n < max; n += BSIZE){
+      uint off = pg->bn * BSIZE;
+      uint m = min(BSIZE, ip->wbsize - off);
+      if(iwrite(ip, 0, (uint64)pg->data, off, m) != m){
+        // keep it, and the pages after it, for a later try.
+        err = -1;
+        break;
+      }
+      ip->dirty = pg->next;
+      ip->ndirty--;
+      left--;
+      wbfree(pg);
+      __atomic_fetch_add(&wb.written, 1, __ATOMIC_RELAXED);
+    }
+    if(ip->ndirty == 0)
+      left = 0;
+    clean = dirty && ip->ndirty == 0;
+    if(clean)
+      wbclean(ip);
+    iunlock(ip);
+    if(clean)
+      iput(ip);
+    end_op();
+    if(dirty)
+      __atomic_fetch_add(&wb.commits, 1, __ATOMIC_RELAXED);
+  }
+  return err;
+}
+
+// Flush every inode with dirty pages, once.
+void
+wbflushall(void)
+{
+  struct inode *ip, **pp;
+  int n = 0;
+
+  acquire(&wb.lock);
+  for(ip = wb.inodes; ip; ip = ip->wbnext)
+    n++;
+  release(&wb.lock);
+
+  while(n-- > 0){
+    // take the first inode and move it to the end of the list,
+    // so that a file that is being written does not hold up
+    // the others.
+    acquire(&wb.lock);
+    if((ip = wb.inodes) != 0){
+      for(pp = &wb.inodes; *pp; pp = &(*pp)->wbnext)
+        ;
+      if(pp != &ip->wbnext){
+        wb.inodes = ip->wbnext;
+        ip->wbnext = 0;
+        *pp = ip;
+      }
+      idup(ip);
+    }
+    release(&wb.lock);
+    if(ip == 0)
+      break;
+    wbflush(ip);
+    begin_op();
+    iput(ip);
+    end_op();
+  }
+}
+
+// The flusher thread writes out dirty pages every WBDELAY ticks,
+// or sooner if many are dirty.
+static void
+wbflusher(void)
+{
+  for(;;){
+    acquire(&tickslock);
+    uint t0 = ticks;
+    while(ticks - t0 < WBDELAY && wb.nused < NWBPAGE / 4)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+    wbflushall();
+  }
+}
+
+int
+statswb(char *buf, int sz)
+{
+  return snprintf(buf, sz, "--- write-back: dirty %d written %d in %d commits\n",
+                  wb.nused, (int)wb.written, (int)wb.commits);
+}
+
 // Directories
 
 int
@@ -576,6 +1422,203 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Hashed directories.
+
+// FNV-1a hash of a name.
+static uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// The bucket of hash h in a directory of nb buckets. Buckets
+// before nb - m have been split, so they and their images at
+// m and after are chosen by one more bit of the hash.
+static uint
+hbucket(uint h, uint nb)
+{
+  uint m = 1;
+
+  while(m * 2 <= nb)
+    m *= 2;
+  if(h % m < nb - m)
+    return h % (2 * m);
+  return h % m;
+}
+
+// Return a locked buf with bucket b of hashed directory dp.
+static struct buf*
+hread(struct inode *dp, uint b)
+{
+  uint run, addr;
+
+  if((addr = bmap_run(dp, b, &run)) == 0)
+    panic("hread");
+  return bread_class(dp->dev, addr, BC_DIR);
+}
+
+#define HHEAD(bp) ((struct dirhead*)(bp)->data)
+#define HENT(bp) ((struct dirent*)(bp)->data)
+
+// Look for name in hashed directory dp: in its own bucket, and
+// in the others only if some of that bucket's names overflowed.
+// Returns the inum, or 0, and sets *poff to the entry's offset.
+static uint
+hlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint nb = dp->size / BSIZE, home = hbucket(dirhash(name), nb);
+  uint inum = 0, over = 1;
+  struct buf *bp;
+
+  for(uint k = 0; k < nb && over && inum == 0; k++){
+    uint b = (home + k) % nb;
+    bp = hread(dp, b);
+    if(k == 0)
+      over = HHEAD(bp)->over;
+    for(int i = 1; i < DPB; i++){
+      if(HENT(bp)[i].inum && namecmp(name, HENT(bp)[i].name) == 0){
+        inum = HENT(bp)[i].inum;
+        if(poff)
+          *poff = b * BSIZE + i * sizeof(struct dirent);
+        break;
+      }
+    }
+    brelse(bp);
+  }
+  return inum;
+}
+
+// Add a bucket to the end of hashed directory dp: either the
+// first one, or the image of the next bucket to split, taking
+// the names that now hash to it. Returns -1 if out of blocks.
+static int
+hgrow(struct inode *dp)
+{
+  uint nb = dp->size / BSIZE, m = 1, addr;
+  struct buf *np, *bp;
+  int j = 1;
+
+  if((addr = bmap(dp, nb, BM_FILL)) == 0)
+    return -1;
+  np = bread_class(dp->dev, addr, BC_DIR);
+  memset(np->data, 0, BSIZE);
+  HHEAD(np)->magic = DIRHMAGIC;
+  if(nb > 0){
+    while(m * 2 <= nb)
+      m *= 2;
+    bp = hread(dp, nb - m);
+    // names of the split bucket that overflowed may now belong
+    // to either bucket.
+    HHEAD(np)->over = HHEAD(bp)->over;
+    for(int i = 1; i < DPB; i++){
+      struct dirent *de = &HENT(bp)[i];
+      if(de->inum && hbucket(dirhash(de->name), nb + 1) == nb){
+        HENT(np)[j++] = *de;
+        memset(de, 0, sizeof(*de));
+      }
+    }
+    if(j > 1)
+      log_write(bp);
+    brelse(bp);
+  }
+  log_write(np);
+  brelse(np);
+  dp->size += BSIZE;
+  iupdate(dp);
+  return 0;
+}
+
+// Count a name added (add = 1) or removed (add = -1) in the
+// total kept by bucket 0, and, if the name's own bucket home
+// was full and it is kept in bucket b, in home's overflow.
+static void
+hcount(struct inode *dp, uint home, uint b, int add)
+{
+  struct buf *bp;
+
+  if(home != b){
+    bp = hread(dp, home);
+    if(add > 0 || HHEAD(bp)->over > 0)
+      HHEAD(bp)->over += add;
+    log_write(bp);
+    brelse(bp);
+  }
+  bp = hread(dp, 0);
+  HHEAD(bp)->total += add;
+  log_write(bp);
+  brelse(bp);
+}
+
+// Add (name, inum) to hashed directory dp, splitting a bucket
+// first if the directory is getting full.
+static int
+hlink(struct inode *dp, char *name, uint inum)
+{
+  struct buf *bp;
+  uint nb, home, b = 0, total;
+  int i = DPB;
+
+  if(dp->size == 0 && hgrow(dp) < 0)
+    return -1;
+  bp = hread(dp, 0);
+  total = HHEAD(bp)->total;
+  brelse(bp);
+  // if no block is left for the split, there is still room
+  // in some bucket.
+  if(total + 1 > dp->size / BSIZE * DIRHLOAD)
+    hgrow(dp);
+
+  nb = dp->size / BSIZE;
+  home = hbucket(dirhash(name), nb);
+  for(uint k = 0; k < nb && i == DPB; k++){
+    b = (home + k) % nb;
+    bp = hread(dp, b);
+    for(i = 1; i < DPB && HENT(bp)[i].inum; i++)
+      ;
+    if(i == DPB)
+      brelse(bp);
+  }
+  if(i == DPB)
+    return -1;
+  strncpy(HENT(bp)[i].name, name, DIRSIZ);
+  HENT(bp)[i].inum = inum;
+  log_write(bp);
+  brelse(bp);
+  hcount(dp, home, b, 1);
+  return 0;
+}
+
+// Remove the entry at offset off of directory dp.
+void
+dirunlink(struct inode *dp, uint off)
+{
+  struct dirent de;
+  struct buf *bp;
+  uint home;
+
+  if((dp->flags & I_HASHDIR) == 0){
+    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+      panic("dirunlink: readi");
+    dcache_enter(dp, de.name, 0);
+    memset(&de, 0, sizeof(de));
+    if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+      panic("dirunlink: writei");
+    return;
+  }
+  bp = hread(dp, off / BSIZE);
+  de = HENT(bp)[off % BSIZE / sizeof(de)];
+  dcache_enter(dp, de.name, 0);
+  home = hbucket(dirhash(de.name), dp->size / BSIZE);
+  memset(&HENT(bp)[off % BSIZE / sizeof(de)], 0, sizeof(de));
+  log_write(bp);
+  brelse(bp);
+  hcount(dp, home, off / BSIZE, -1);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -587,6 +1630,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR && !dev_dir)
     panic("dirlookup not DIR");
 
+  if(!dev_dir && (dp->flags & I_HASHDIR)){
+    if((inum = hlookup(dp, name, poff)) == 0)
+      return 0;
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size || dev_dir; off += sizeof(de)){
     if(dev_dir){
       if(devsw[dp->major].read(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -630,6 +1679,13 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  if(dp->flags & I_HASHDIR){
+    if(hlink(dp, name, inum) < 0)
+      return -1;
+    dcache_enter(dp, name, inum);
+    return 0;
+  }
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -642,6 +1698,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
+  dcache_enter(dp, name, inum);
 
   return 0;
 }
@@ -700,6 +1757,22 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    if(!nameiparent || *path != '\0'){
+      // try the name cache, which needs no lock on ip.
+      uint inum, seq;
+      if(dcache_lookup(ip->dev, ip->inum, name, &inum, &seq)){
+        next = inum ? iget(ip->dev, inum) : 0;
+        if(dcache_valid(seq)){
+          iput(ip);
+          if(next == 0)
+            return 0;
+          ip = next;
+          continue;
+        }
+        if(next)
+          iput(next);
+      }
+    }
     ilock(ip);
     if(ip->type != T_DIR && !IS_DEV_DIR(ip)){
       iunlockput(ip);
@@ -711,9 +1784,11 @@ namex(char *path, int nameiparent, char *name)
       return ip;
     }
     if((next = dirlookup(ip, name, 0)) == 0){
+      dcache_enter(ip, name, 0);
       iunlockput(ip);
       return 0;
     }
+    dcache_enter(ip, name, next->inum);
     iunlockput(ip);
     ip = next;
   }
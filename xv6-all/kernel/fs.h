@@ -21,6 +21,7 @@ struct superblock {
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
   uint swapstart;    // Block number of first swapping block
+  uint nswap;        // Number of swap blocks
 };
 
 #define FSMAGIC 0x10203040
@@ -32,6 +33,25 @@ struct superblock {
 #define MAXFILE (NDIRECT + NINDIRECT + 10 * NINDIRECT)
 #define MAXSYMLINKDEPTH 10
 
+// A run of len consecutive disk blocks starting at start.
+struct extent {
+  uint start;
+  uint len;
+};
+
+#define NEXTENT 13  // extents in the inode
+#define NEXTPB ((BSIZE - sizeof(uint)) / sizeof(struct extent))
+
+// Block that continues an inode's list of extents.
+struct extblock {
+  uint next;                    // next extent block, or 0
+  struct extent ext[NEXTPB];
+};
+
+// dinode flags
+#define I_EXTENT 0x1  // data blocks are mapped by ext[], not addrs[]
+#define I_HASHDIR 0x2 // directory entries are hashed into blocks
+
 // On-disk inode structure
 struct dinode {
   short type;           // File type
@@ -39,7 +59,13 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[TOTBUF];   // Data block addresses
+  uint flags;           // I_EXTENT, I_HASHDIR
+  union {
+    uint addrs[TOTBUF];         // Data block addresses
+    struct extent ext[NEXTENT]; // Runs of data blocks, in file order
+  };
+  uint extblk;          // First extent block, if ext[] is full
+  uint unused;
 };
 
 // Inodes per block.
@@ -62,3 +88,25 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Dirents per block.
+#define DPB (BSIZE / sizeof(struct dirent))
+
+// A hashed directory is a linear hash table with one bucket per
+// block. A name is kept in its own bucket unless that is full.
+// The first dirent of each bucket is this header instead; its
+// inum is 0, so programs that read the directory skip it.
+struct dirhead {
+  ushort inum;      // always 0
+  ushort magic;     // DIRHMAGIC
+  ushort over;      // at least the number of this bucket's names
+                    // kept in other buckets
+  ushort unused;
+  uint total;       // names in the directory (bucket 0 only)
+  uint pad;
+};
+
+#define DIRHMAGIC 0x6864
+// split a bucket when there are more names per bucket than this.
+// a bucket not yet split holds about twice the average.
+#define DIRHLOAD  112
+
@@ -1,6 +1,7 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// and runs of 2^k contiguous pages such as superpages.
 
 #include "types.h"
 #include "param.h"
@@ -10,220 +11,515 @@
 #include "defs.h"
 
 void freerange(void *pa_start, void *pa_end);
-void freerange_suppage(void *pa_start, void *pa_end);
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
 struct run {
   struct run *next;
+  struct run *prev;  // in kbuddy's lists
 };
 
-struct super_run {
-  struct super_run *next;
-};
+// Each CPU keeps a magazine of free pages that only it uses, so
+// most kalloc() and kfree() calls touch no shared cache lines.
+// An empty magazine is refilled from the buddy allocator, and a
+// full one drained into it, KBATCH pages at a time. Only when
+// that is empty too does a CPU take pages from another CPU's
+// magazine. Lock order: a CPU's magazine, then kbuddy.
+#define KMAG   64   // pages in a CPU's magazine
+#define KBATCH 32   // pages moved to or from the pool at once
 
-struct {
+struct kmem {
   struct spinlock lock;
-  struct run *freelist;
+  int n;
+  void *page[KMAG];
   char name[20];
 } kmems[NCPU];
 
+// The buddy allocator owns all free memory not in a magazine.
+// A free block of 2^k pages starts at a page index (counted from
+// KERNBASE, so superpages are aligned) that is a multiple of 2^k,
+// and is on list free[k]. When a block is freed and its buddy,
+// the other half of the block twice its size, is free as well,
+// the two are joined.
+#define NPAGE    ((PHYSTOP - KERNBASE) / PGSIZE)
+#define MAXORDER 10   // largest block: 4 MB
+#define KB_FREE  1    // page starts a free block of order[] pages
+#define KB_SUPER 2    // page starts an allocated superpage
+
+struct {
+  struct spinlock lock;
+  struct run free[MAXORDER+1];  // list heads
+  int n;                        // free pages on the lists
+  uchar order[NPAGE];
+  uchar flags[NPAGE];
+} kbuddy;
+
+// Pages zeroed ahead of time by idle CPUs, for kalloc_zeroed().
+// A page on its way from a magazine to the pool is counted in
+// busy, under the magazine's lock and then the pool's, so that
+// kcollect() sees every free page.
+// Lock order: a CPU's magazine, kbuddy, then kzero.
+#define NZERO 256   // zeroed pages to keep
 
-struct super_run *super_freelist;
-int ref_cnt[COW_REFIDX(PHYSTOP)];
-struct spinlock ref_lock; // protect ref_cnt
-struct spinlock sup_lock; // protect super_freelist 
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int n;
+  int busy;        // pages being zeroed
+  uint64 hits;     // kalloc_zeroed() calls it served...
+  uint64 misses;   // ...and did not
+} kzero;
+
+int ref_cnt[COW_REFIDX(PHYSTOP)]; // references to each page, atomic
+
+// Reverse map: the user PTEs that map each page, so that a page
+// can be aged and swapped out, from every page table that shares
+// it, without searching the processes. An entry names a PTE by
+// the page-table page that holds it and its slot there, and the
+// page table it belongs to, in 8 bytes. A page that had a mapping
+// the pool had no room for is marked lost, and is never swapped.
+#define NRMAP NPAGE
+#define RNIL  0xffff   // NPAGE must be less
+
+struct rmapent {
+  ushort ptp;    // page-table page holding the PTE
+  ushort slot;   // index of the PTE in it
+  ushort root;   // the page table
+  ushort next;
+};
+
+struct {
+  struct spinlock lock;
+  struct rmapent ent[NRMAP];
+  ushort free;
+  ushort head[NPAGE];
+  uchar lost[NPAGE];
+  struct spinlock *held[NPROC];  // tlocks rmap_swapout() has taken
+} rmap;
+
+#define PA2IDX(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define IDX2PA(i)  ((void*)(KERNBASE + (uint64)(i) * PGSIZE))
 
 void
 kinit()
 {
-  initlock(&ref_lock, "reflock");
-  initlock(&sup_lock, "suplock");
+  initlock(&kbuddy.lock, "kmem");
+  initlock(&kzero.lock, "kzero");
+  for (int k = 0; k <= MAXORDER; k++)
+    kbuddy.free[k].next = kbuddy.free[k].prev = &kbuddy.free[k];
   for (int i = 0; i < NCPU; i++) {
     snprintf(kmems[i].name, 20, "kmem-%d", i);
     initlock(&kmems[i].lock, kmems[i].name);
   }
+  initlock(&rmap.lock, "rmap");
+  for (int i = 0; i < NPAGE; i++)
+    rmap.head[i] = RNIL;
+  for (int i = 0; i < NRMAP; i++)
+    rmap.ent[i].next = i + 1 < NRMAP ? i + 1 : RNIL;
+  rmap.free = 0;
   freerange(end, (void*)PHYSTOP);
-  freerange_suppage((void*)PHYSTOP, (void*)PHYSTOP_INCLUDESUPPG);
 }
 
+static void bput(uint64, int);
+static void rmap_clear(uint64);
+
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p = (char*)PGROUNDUP((uint64)pa_start);
-  for(uint64 i = COW_REFIDX((uint64)p); p + PGSIZE <= (char*)pa_end; p += PGSIZE, i++) {
-    ref_cnt[i] = 1;
-    kfree(p); 
+  acquire(&kbuddy.lock);
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+    bput(PA2IDX(p), 0);
+  release(&kbuddy.lock);
+}
+
+// Give the block of 2^k pages at index i to the buddy
+// allocator, joining it with its free buddies.
+// Caller holds kbuddy.lock.
+static void
+bput(uint64 i, int k)
+{
+  struct run *r;
+
+  kbuddy.n += 1 << k;
+  for(; k < MAXORDER; k++){
+    uint64 b = i ^ (1 << k);
+    if(b + (1 << k) > NPAGE || !(kbuddy.flags[b] & KB_FREE) || kbuddy.order[b] != k)
+      break;
+    r = IDX2PA(b);
+    r->prev->next = r->next;
+    r->next->prev = r->prev;
+    kbuddy.flags[b] &= ~KB_FREE;
+    if(b < i)
+      i = b;
   }
+  r = IDX2PA(i);
+  r->next = kbuddy.free[k].next;
+  r->prev = &kbuddy.free[k];
+  r->next->prev = r;
+  kbuddy.free[k].next = r;
+  kbuddy.flags[i] |= KB_FREE;
+  kbuddy.order[i] = k;
 }
 
-void freerange_suppage(void *pa_start, void *pa_end)
+// Take a block of 2^k pages from the buddy allocator, splitting
+// a larger one if need be. Returns its index, or -1.
+// Caller holds kbuddy.lock.
+static int
+bget(int k)
 {
-  char *p = (char *)pa_start;
-  for(; p + SUPPGSIZE <= (char*)pa_end; p += SUPPGSIZE) {
-    kfree_suppage(p);
+  struct run *r;
+  int j;
+
+  for(j = k; j <= MAXORDER && kbuddy.free[j].next == &kbuddy.free[j]; j++)
+    ;
+  if(j > MAXORDER)
+    return -1;
+  r = kbuddy.free[j].next;
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  uint64 i = PA2IDX(r);
+  kbuddy.flags[i] &= ~KB_FREE;
+  // give back the upper halves.
+  while(j > k){
+    j--;
+    struct run *h = IDX2PA(i + (1 << j));
+    h->next = kbuddy.free[j].next;
+    h->prev = &kbuddy.free[j];
+    h->next->prev = h;
+    kbuddy.free[j].next = h;
+    kbuddy.flags[i + (1 << j)] |= KB_FREE;
+    kbuddy.order[i + (1 << j)] = j;
   }
+  kbuddy.n -= 1 << k;
+  return i;
+}
 
+// Move the top KBATCH pages of full magazine c to kbuddy.
+// Caller holds c->lock.
+static void
+kdrain(struct kmem *c)
+{
+  acquire(&kbuddy.lock);
+  for(int k = 0; k < KBATCH; k++)
+    bput(PA2IDX(c->page[--c->n]), 0);
+  release(&kbuddy.lock);
+}
+
+// Refill empty magazine c with up to KBATCH pages from kbuddy.
+// Caller holds c->lock.
+static void
+krefill(struct kmem *c)
+{
+  int i;
+
+  acquire(&kbuddy.lock);
+  while(c->n < KBATCH && (i = bget(0)) >= 0)
+    c->page[c->n++] = IDX2PA(i);
+  release(&kbuddy.lock);
+}
+
+// Return the pages of every magazine and of the zeroed pool to
+// kbuddy, so that they can be joined into larger blocks.
+static void
+kdrainall(void)
+{
+  struct run *r;
+
+  for(int j = 0; j < NCPU; j++){
+    acquire(&kmems[j].lock);
+    acquire(&kbuddy.lock);
+    while(kmems[j].n > 0)
+      bput(PA2IDX(kmems[j].page[--kmems[j].n]), 0);
+    release(&kbuddy.lock);
+    release(&kmems[j].lock);
+  }
+  acquire(&kbuddy.lock);
+  acquire(&kzero.lock);
+  while((r = kzero.freelist) != 0){
+    kzero.freelist = r->next;
+    kzero.n--;
+    bput(PA2IDX(r), 0);
+  }
+  release(&kzero.lock);
+  release(&kbuddy.lock);
+}
+
+// Take up to KBATCH pages, half of what another CPU has, into
+// page[]. Returns how many.
+static int
+ksteal(int self, void **page)
+{
+  int n = 0;
+
+  for(int j = 0; j < NCPU && n == 0; j++){
+    if(j == self)
+      continue;
+    acquire(&kmems[j].lock);
+    int take = (kmems[j].n + 1) / 2;
+    if(take > KBATCH)
+      take = KBATCH;
+    while(n < take)
+      page[n++] = kmems[j].page[--kmems[j].n];
+    release(&kmems[j].lock);
+  }
+  return n;
 }
 
 // Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// which should have been returned by a call to kalloc().
+// Only the last reference frees it.
 void
 kfree(void *pa)
 {
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
-  acquire(&ref_lock);
-  int idx = COW_REFIDX((uint64) pa);
-  if (ref_cnt[idx] < 1) panic("kfree ref_cnt");
-  int res = --ref_cnt[idx];
-  release(&ref_lock);
-
+  int res = __atomic_sub_fetch(&ref_cnt[COW_REFIDX((uint64) pa)], 1, __ATOMIC_ACQ_REL);
+  if (res < 0) panic("kfree ref_cnt");
   if(res > 0) return;
+  if(rmap.head[PA2IDX(pa)] != RNIL || rmap.lost[PA2IDX(pa)])
+    rmap_clear(PA2IDX(pa));
 
+#ifdef KJUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
-
-  struct run *r = (struct run*)pa;
+#endif
 
   push_off();
   int i = cpuid();
   
   acquire(&kmems[i].lock);
-  r->next = kmems[i].freelist;
-  kmems[i].freelist = r;
+  if(kmems[i].n == KMAG)
+    kdrain(&kmems[i]);
+  kmems[i].page[kmems[i].n++] = pa;
   release(&kmems[i].lock);
   pop_off();
 }
 
 
-void
-kfree_suppage(void *pa)
+// Take a page from the zeroed pool, or return 0.
+static void *
+kztake(void)
 {
-  
-  struct super_run *r;
-
-  if(((uint64)pa % SUPPGSIZE) != 0 || (uint64)pa < PHYSTOP || (uint64)pa >= PHYSTOP_INCLUDESUPPG)
-    panic("kfree_suppage");
-  
-  // Fill with junk to catch dangling refs.
-  memset(pa, 1, SUPPGSIZE);
-  r = (struct super_run*)pa;
-  
-  acquire(&sup_lock);
-  r->next = super_freelist;
-  super_freelist = r;
-  release(&sup_lock);
-}
+  struct run *r;
 
-struct run *
-ksteal(struct run *head)
-{
-  struct run *slow = head, *fast = head->next;
-  while (fast && fast->next) {
-    slow = slow->next;
-    fast = fast->next->next;
+  acquire(&kzero.lock);
+  if((r = kzero.freelist) != 0){
+    kzero.freelist = r->next;
+    kzero.n--;
   }
-  fast = slow->next;
-  slow->next = 0;
-  return fast;
+  release(&kzero.lock);
+  if(r)
+    r->next = 0;  // the rest of the page is still zero
+  return r;
 }
 
-
-// Allocate one 4096-byte page of physical memory.
-// Returns a pointer that the kernel can use.
-// Returns 0 if the memory cannot be allocated.
-void *
-kalloc(void)
+// Take a free page: from this CPU's magazine, kbuddy, another
+// CPU's magazine, or the zeroed pool. Returns 0 if there is none.
+static void *
+kget(void)
 {
-  struct run *r;
+  void *r = 0;
+  void *stolen[KBATCH];
 
   push_off();
   int i = cpuid();
   
   acquire(&kmems[i].lock);
-  r = kmems[i].freelist;
-  if(r)
-    kmems[i].freelist = r->next;
+  if(kmems[i].n == 0)
+    krefill(&kmems[i]);
+  if(kmems[i].n > 0)
+    r = kmems[i].page[--kmems[i].n];
   release(&kmems[i].lock);
   if (!r) {
-    for (int j = 0; j < NCPU && !r; j++) {
-      if (j == i) continue;
-      acquire(&kmems[j].lock);
-      if (kmems[j].freelist) {
-        r = kmems[j].freelist;
-        kmems[j].freelist = ksteal(kmems[j].freelist);
-      }
-      release(&kmems[j].lock);
-    }
-    if (r) {
+    // don't hold our own lock while taking another CPU's.
+    int n = ksteal(i, stolen);
+    if (n > 0) {
+      r = stolen[--n];
+      // our magazine is still empty: only we add to it.
       acquire(&kmems[i].lock);
-      kmems[i].freelist = r->next;
+      while (n > 0)
+        kmems[i].page[kmems[i].n++] = stolen[--n];
       release(&kmems[i].lock);
     }
   }
   pop_off();
 
   if(!r)
-    r = (struct run*)find_swapping_page(ref_cnt, &ref_lock);
+    r = kztake();
+  return r;
+}
+
+// Allocate a page without swapping anything out to find one, for
+// the swap code itself. Returns 0 if no page is free.
+void *
+kalloc_noswap(void)
+{
+  void *r = kget();
 
   if(r){
     if (kincget(r) != 1) panic("kalloc_ref_cnt");
+#ifdef KJUNK
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
   }
-    
-  return (void*)r;
+  return r;
 }
 
-void * 
-kalloc_suppage() 
+// Allocate one 4096-byte page of physical memory.
+// Returns a pointer that the kernel can use.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc(void)
+{
+  void *r;
+
+  // the reclaim thread should keep pages free; if it has fallen
+  // behind, swap some out here.
+  if((r = kalloc_noswap()) == 0 && (reclaim(RECLAIM_BATCH) > 0 || reclaim_oldest() > 0))
+    r = kalloc_noswap();
+  return r;
+}
+
+// Allocate a page of zeros, from the pool that idle CPUs fill
+// if it can.
+void *
+kalloc_zeroed(void)
 {
-  struct super_run *r;
+  void *r;
 
-  acquire(&sup_lock);
-  r = super_freelist;
-  if (r) {
-    super_freelist = r->next;
+  if((r = kztake()) != 0){
+    if (kincget(r) != 1) panic("kalloc_zeroed ref_cnt");
+    __atomic_fetch_add(&kzero.hits, 1, __ATOMIC_RELAXED);
+    return r;
   }
-  release(&sup_lock);
+  __atomic_fetch_add(&kzero.misses, 1, __ATOMIC_RELAXED);
+  if((r = kalloc()) != 0)
+    memset(r, 0, PGSIZE);
+  return r;
+}
 
-  if(r)
-    memset((char*)r, 5, SUPPGSIZE); // fill with junk
-  return (char*) r;
+// Called by scheduler() when it found nothing to run: zero a
+// free page for kalloc_zeroed(), if the pool is short of them.
+void
+kzero_idle(void)
+{
+  struct run *r = 0;
+
+  if(kzero.n >= NZERO)
+    return;
+  push_off();
+  int i = cpuid();
+  acquire(&kmems[i].lock);
+  if(kmems[i].n == 0)
+    krefill(&kmems[i]);
+  if(kmems[i].n > 0){
+    r = kmems[i].page[--kmems[i].n];
+    __atomic_fetch_add(&kzero.busy, 1, __ATOMIC_RELAXED);
+  }
+  release(&kmems[i].lock);
+  pop_off();
+  if(r == 0)
+    return;
+
+  memset(r, 0, PGSIZE);
+  acquire(&kzero.lock);
+  r->next = kzero.freelist;
+  kzero.freelist = r;
+  kzero.n++;
+  __atomic_fetch_sub(&kzero.busy, 1, __ATOMIC_RELAXED);
+  release(&kzero.lock);
+}
+
+void
+kzeroinfo(uint64 *depth, uint64 *hits, uint64 *misses)
+{
+  *depth = kzero.n;
+  *hits = kzero.hits;
+  *misses = kzero.misses;
 }
 
+// Allocate 2^order physically contiguous pages, aligned to
+// their size. Returns 0 if there is no such block free.
 void *
-kalloc_cow(pte_t *pte)
+kalloc_pages(int order)
 {
-  uint64 pa = PTE2PA(*pte);
-  int idx = COW_REFIDX(pa);
-  acquire(&ref_lock);
-  
-  if (ref_cnt[idx] < 1) panic("kalloc_cow ref_cnt");
-  if (ref_cnt[idx] == 1){
-    *pte = PTE_DECOW(*pte);
-    release(&ref_lock);
-    return (void*)pa;
+  int i;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  acquire(&kbuddy.lock);
+  i = bget(order);
+  release(&kbuddy.lock);
+  if(i < 0){
+    // the pieces may be sitting in the magazines.
+    kdrainall();
+    acquire(&kbuddy.lock);
+    i = bget(order);
+    release(&kbuddy.lock);
   }
-  ref_cnt[idx]--;
-  if (ref_cnt[idx] < 1) panic("kfree_cow ref_cnt");
-  release(&ref_lock);
-  void * res;
-  if((res = kalloc()) == 0)
-    kincget((void *)pa);
-  return res;  
+  if(i < 0)
+    return 0;
+  if (kincget(IDX2PA(i)) != 1) panic("kalloc_pages ref_cnt");
+#ifdef KJUNK
+  memset(IDX2PA(i), 5, PGSIZE << order); // fill with junk
+#endif
+  return IDX2PA(i);
+}
+
+// Free pages allocated by kalloc_pages(order).
+void
+kfree_pages(void *pa, int order)
+{
+  uint64 i = PA2IDX(pa);
+
+  if(((uint64)pa % (PGSIZE << order)) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kfree_pages");
+  if (__atomic_sub_fetch(&ref_cnt[i], 1, __ATOMIC_ACQ_REL) != 0)
+    panic("kfree_pages ref_cnt");
+#ifdef KJUNK
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, PGSIZE << order);
+#endif
+  acquire(&kbuddy.lock);
+  bput(i, order);
+  release(&kbuddy.lock);
+}
+
+#define SUPPGORDER 9   // SUPPGSIZE / PGSIZE == 1 << SUPPGORDER
+
+void * 
+kalloc_suppage()
+{
+  char *pa = kalloc_pages(SUPPGORDER);
+
+  if(pa)
+    __atomic_fetch_or(&kbuddy.flags[PA2IDX(pa)], KB_SUPER, __ATOMIC_RELEASE);
+  return pa;
+}
+
+void
+kfree_suppage(void *pa)
+{
+  if(!kis_suppage((uint64)pa))
+    panic("kfree_suppage");
+  __atomic_fetch_and(&kbuddy.flags[PA2IDX(pa)], ~KB_SUPER, __ATOMIC_RELEASE);
+  kfree_pages(pa, SUPPGORDER);
+}
+
+// Is pa the start of a superpage from kalloc_suppage()?
+int
+kis_suppage(uint64 pa)
+{
+  return pa >= KERNBASE && pa < PHYSTOP && pa % SUPPGSIZE == 0 &&
+    (__atomic_load_n(&kbuddy.flags[PA2IDX(pa)], __ATOMIC_ACQUIRE) & KB_SUPER);
 }
 
 int
 kincget(void *pa)
 {
-  acquire(&ref_lock);
-  int res = ++ref_cnt[COW_REFIDX((uint64)pa)];
-  release(&ref_lock);
-  return res;
+  return __atomic_add_fetch(&ref_cnt[COW_REFIDX((uint64)pa)], 1, __ATOMIC_ACQ_REL);
 }
 
 uint savedpg = 0;
@@ -231,33 +527,242 @@ uint64 savedbyte = 0;
 
 uint 
 saved_page(int unit){
-  acquire(&ref_lock);
-  savedpg += unit;
-  uint tmp = savedpg;
-  release(&ref_lock);
-  return tmp;
+  return __atomic_add_fetch(&savedpg, unit, __ATOMIC_RELAXED);
 }
 
 uint64 
 saved_byte(int unit){
-  acquire(&ref_lock);
-  savedbyte += unit;
-  uint64 tmp = savedbyte;
-  release(&ref_lock);
-  return tmp;
+  return __atomic_add_fetch(&savedbyte, unit, __ATOMIC_RELAXED);
+}
+
+static pte_t *
+rmap_pte(struct rmapent *e)
+{
+  return (pte_t*)IDX2PA(e->ptp) + e->slot;
+}
+
+// Is pa a page the reverse map keeps track of?
+static int
+rmappable(uint64 pa)
+{
+  return pa >= (uint64)end && pa < PHYSTOP && !kis_suppage(pa);
+}
+
+// Record that pte, in page table pt, maps its page.
+void
+rmap_add(pagetable_t pt, pte_t *pte)
+{
+  uint64 pa = PTE2PA(*pte);
+  uint64 i = PA2IDX(pa);
+  ushort e;
+
+  if(!(*pte & PTE_V) || !rmappable(pa))
+    return;
+  acquire(&rmap.lock);
+  if((e = rmap.free) == RNIL){
+    rmap.lost[i] = 1;
+  } else {
+    rmap.free = rmap.ent[e].next;
+    rmap.ent[e].ptp = PA2IDX(PGROUNDDOWN((uint64)pte));
+    rmap.ent[e].slot = ((uint64)pte % PGSIZE) / sizeof(pte_t);
+    rmap.ent[e].root = PA2IDX(pt);
+    rmap.ent[e].next = rmap.head[i];
+    rmap.head[i] = e;
+  }
+  release(&rmap.lock);
+}
+
+// pte is about to stop mapping its page: forget it.
+void
+rmap_remove(pte_t *pte)
+{
+  ushort *ep;
+
+  acquire(&rmap.lock);
+  if((*pte & PTE_V) && rmappable(PTE2PA(*pte))){
+    for(ep = &rmap.head[PA2IDX(PTE2PA(*pte))]; *ep != RNIL; ep = &rmap.ent[*ep].next){
+      if(rmap_pte(&rmap.ent[*ep]) == pte){
+        ushort e = *ep;
+        *ep = rmap.ent[e].next;
+        rmap.ent[e].next = rmap.free;
+        rmap.free = e;
+        break;
+      }
+    }
+  }
+  release(&rmap.lock);
+}
+
+// Drop whatever the reverse map has for page i, which is free.
+static void
+rmap_clear(uint64 i)
+{
+  acquire(&rmap.lock);
+  while(rmap.head[i] != RNIL){
+    ushort e = rmap.head[i];
+    rmap.head[i] = rmap.ent[e].next;
+    rmap.ent[e].next = rmap.free;
+    rmap.free = e;
+  }
+  rmap.lost[i] = 0;
+  release(&rmap.lock);
+}
+
+// Has the page at pa been used since the last call? Clears the
+// accessed bit of every PTE that maps it, without a TLB flush, so
+// the answer is only a hint for aging; rmap_swapout() doesn't rely
+// on it to keep a page from changing. Returns -1 if the page
+// is not mapped in a way that lets it be swapped out: not mapped
+// by user page tables we know all of, or mapped by init or the
+// shell, which must never wait for memory to page in.
+int
+rmap_referenced(uint64 pa)
+{
+  uint64 i = PA2IDX(pa);
+  int n = 0, used = 0, pinned = 0;
+
+  if(!rmappable(pa) || rmap.head[i] == RNIL)
+    return -1;
+  acquire(&rmap.lock);
+  for(ushort e = rmap.head[i]; e != RNIL; e = rmap.ent[e].next){
+    pte_t *pte = rmap_pte(&rmap.ent[e]);
+    if(pagetable_pinned(IDX2PA(rmap.ent[e].root)))
+      pinned = 1;
+    if(*pte & PTE_A){
+      used = 1;
+      *pte &= ~PTE_A;
+    }
+    n++;
+  }
+  if(pinned || rmap.lost[i] || n != __atomic_load_n(&ref_cnt[i], __ATOMIC_ACQUIRE))
+    used = -1;
+  release(&rmap.lock);
+  return used;
+}
+
+// Take a reference to the page at pa if user page tables map it,
+// so that it can't be freed and reused while the caller looks at
+// it. Returns 1 if it did; the caller kfree()s the page when done.
+int
+rmap_pin(uint64 pa)
+{
+  int r = 0;
+
+  if(!rmappable(pa))
+    return 0;
+  acquire(&rmap.lock);
+  // a mapping's reference can't go away while rmap.lock is held.
+  if(rmap.head[PA2IDX(pa)] != RNIL){
+    kincget((void*)pa);
+    r = 1;
+  }
+  release(&rmap.lock);
+  return r;
+}
+
+// Take the page at pa, which the caller has pinned with
+// rmap_pin(), out of every page table that maps it, making each
+// PTE refer to swap slot idx instead: if it is still unused since
+// it was last aged, and only its n mappings and the pin refer to
+// it. Each PTE is changed under its process's tlock, so that the
+// change doesn't race with the kernel's other updates of the PTE;
+// page tables not yet added to pts[0..*npts-1], which has room for
+// NPROC, are added, for the caller to flush from TLBs before it
+// copies the page. Returns n, or 0 if the page is in use. Either
+// way the pin is left for the caller to kfree().
+int
+rmap_swapout(uint64 pa, int idx, int n, pagetable_t *pts, int *npts)
+{
+  uint64 i = PA2IDX(pa);
+  int k = 0, nheld = 0, npt = *npts, ok = 1;
+
+  if(!rmappable(pa) || n <= 0)
+    return 0;
+  acquire(&rmap.lock);
+  for(ushort e = rmap.head[i]; e != RNIL && ok; e = rmap.ent[e].next){
+    pagetable_t pt = IDX2PA(rmap.ent[e].root);
+    pte_t *pte = rmap_pte(&rmap.ent[e]);
+    struct spinlock *lk;
+    int j;
+
+    if(pagetable_pinned(pt) || (lk = pagetable_tlock(pt)) == 0){
+      ok = 0;
+      break;
+    }
+    // tlock comes before rmap.lock, so don't wait for it.
+    for(j = 0; j < nheld && rmap.held[j] != lk; j++)
+      ;
+    if(j == nheld){
+      if(nheld == NPROC || !tryacquire(lk)){
+        ok = 0;
+        break;
+      }
+      rmap.held[nheld++] = lk;
+    }
+    for(j = 0; j < npt && pts[j] != pt; j++)
+      ;
+    if(j == npt){
+      if(npt == NPROC){
+        ok = 0;
+        break;
+      }
+      pts[npt++] = pt;
+    }
+    if((*pte & (PTE_V|PTE_A)) != PTE_V || PTE2PA(*pte) != pa)
+      ok = 0;
+    k++;
+  }
+  int c = n + 1;
+  if(ok && k == n && !rmap.lost[i] &&
+     __atomic_compare_exchange_n(&ref_cnt[i], &c, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+    while(rmap.head[i] != RNIL){
+      ushort e = rmap.head[i];
+      pte_t *pte = rmap_pte(&rmap.ent[e]);
+      *pte = PTE_PGOUT(idx, PTE_FLAGS(*pte));
+      rmap.head[i] = rmap.ent[e].next;
+      rmap.ent[e].next = rmap.free;
+      rmap.free = e;
+    }
+    *npts = npt;
+  } else {
+    n = 0;
+  }
+  while(nheld > 0)
+    release(rmap.held[--nheld]);
+  release(&rmap.lock);
+  return n;
+}
+
+// Number of free pages, without locking, for the reclaim thread.
+int
+kfreepages(void)
+{
+  int n = __atomic_load_n(&kbuddy.n, __ATOMIC_RELAXED) +
+          __atomic_load_n(&kzero.n, __ATOMIC_RELAXED);
+
+  for (int j = 0; j < NCPU; j++)
+    n += __atomic_load_n(&kmems[j].n, __ATOMIC_RELAXED);
+  return n;
+}
+
+// References to the page at pa.
+int
+krefcnt(uint64 pa)
+{
+  return __atomic_load_n(&ref_cnt[COW_REFIDX(pa)], __ATOMIC_ACQUIRE);
 }
 
 int 
 kcollect(void)
 {
-  struct run *r;
-  int n = 0;
+  int n;
   for (int j = 0; j < NCPU; j++) acquire(&kmems[j].lock);
-  for (int j = 0; j < NCPU; j++) {
-    r = kmems[j].freelist;
-    for (;r; r = r->next) n++;
-  }
+  acquire(&kbuddy.lock);
+  acquire(&kzero.lock);
+  n = kbuddy.n + kzero.n + kzero.busy;
+  for (int j = 0; j < NCPU; j++) n += kmems[j].n;
+  release(&kzero.lock);
+  release(&kbuddy.lock);
   for (int j = 0; j < NCPU; j++) release(&kmems[j].lock);
   return n * PGSIZE;
 }
-
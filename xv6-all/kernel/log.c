@@ -6,6 +6,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
@@ -16,40 +17,104 @@
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. begin_op() reserves log space for
+// MAXOPBLOCKS blocks; a call that knows it will write more
+// or fewer, like a large write(), uses begin_opn() instead.
+// Usually begin_op() just increments the count of in-progress
+// FS system calls and returns. But if the reservation would
+// not fit in the log, it sleeps until the last outstanding
+// end_op() commits.
 //
-// The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
-
-// Contents of the header block, used for both the on-disk header block
+// The log is a physical re-do log containing disk blocks,
+// kept as a circular buffer of transactions. The on-disk format:
+//   anchor block: seq and position of the oldest transaction
+//                 that recovery must replay
+//   ring of transactions, each:
+//     commit record, containing seq, crc and block #s for A, B, C, ...
+//     block A
+//     block B
+//     block C
+//     ...
+//
+// The last end_op() of a transaction copies the logged blocks
+// out of the buffer cache; only this copy holds up new
+// begin_op()s. It then writes the commit record and the copies
+// to the log in one disk request. The crc in the record lets
+// recovery tell a complete transaction from a torn one, so no
+// separate header write is needed to commit, and none to erase
+// the transaction afterwards. Installing the blocks at their
+// home locations is left to the loginstall kernel thread, which
+// works through committed transactions in order; it rewrites
+// the anchor only when the ring runs short of space. Recovery
+// replays the chain of transactions from the anchor, which
+// may include some already installed, until a record is
+// missing or fails its check. The log area is only ever
+// accessed with raw buffers, never through the cache.
+
+#define LOGMAGIC 0x6c6f6731  // "log1"
+
+// Contents of a commit record, used for both the on-disk record
 // and to keep track in memory of logged block# before commit.
 struct logheader {
+  uint magic;
+  uint seq;   // commit order; consecutive along the ring
   int n;
+  uint crc;   // of block[] and the n logged blocks
   int block[LOGSIZE];
 };
 
+// Contents of the anchor block.
+struct loganchor {
+  uint magic;
+  uint seq;   // seq of the first transaction to replay
+  uint pos;   // where in the ring to look for it
+};
+
+enum { LT_FREE, LT_COMMIT, LT_INSTALL };
+
+// A transaction being written to the log or installed,
+// with the in-memory copy of its blocks.
+struct logtrans {
+  int state;          // LT_*, protected by log.lock
+  uint64 lsn;         // ring position of its record, counting laps
+  struct logheader lh;
+  struct buf *pin[LOGSIZE]; // cached blocks pinned until installed
+  struct buf hb;            // raw buffer for the record
+  struct buf lb[LOGSIZE];   // raw buffers for the copied blocks
+  struct buf *io[LOGSIZE+1]; // the record and blocks in disk order, for rawio()
+};
+
 struct log {
   struct spinlock lock;
-  int start;
-  int size;
+  int start;       // block # of the anchor
+  int size;        // blocks in the ring
+  int cap;         // max blocks in one transaction
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // blocks reserved by the executing calls.
+  int committing;  // copying out a transaction, please wait.
+  int wantspace;   // a commit waits for the anchor to advance
   int dev;
-  struct logheader lh;
+  uint seq;        // seq of the next transaction to commit
+  uint durable;    // seq of the next transaction to finish writing
+  uint installed;  // seq of the next transaction to install
+  uint64 head;     // lsn of the next transaction
+  uint64 itail;    // lsn just past the last installed transaction
+  uint64 tail;     // lsn the anchor points at; the ring is free up to it
+  struct logheader lh;      // the transaction being built
+  struct buf *pin[LOGSIZE]; // its pinned buffers
+  struct logtrans trans[NLOGTRANS];
+  struct buf ab;   // raw buffer for the anchor
+  uint64 ncommit;  // transactions committed
+  uint64 nlogged;  // blocks written to the log
+  uint64 nanchor;  // anchor writes
 };
 struct log log;
 
+static uint crctab[256];
+
 static void recover_from_log(void);
-static void commit();
+static void commit(struct logtrans*);
+static void loginstall(void);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -58,153 +123,394 @@ initlog(int dev, struct superblock *sb)
     panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
-  log.start = sb->logstart;
-  log.size = sb->nlog;
   log.dev = dev;
+  log.start = sb->logstart;
+  log.size = sb->nlog - 1;
+  // a transaction that does not fit before the end of the ring
+  // skips to its start, so a commit can need twice its size.
+  log.cap = log.size / 2 - 1;
+  if (log.cap > LOGSIZE)
+    log.cap = LOGSIZE;
+  // the building transaction and each committing one pin their
+  // blocks in the cache; keep them to half of it.
+  if (log.cap > NBUF / (2 * (NLOGTRANS + 1)))
+    log.cap = NBUF / (2 * (NLOGTRANS + 1));
+  if (log.cap < MAXOPBLOCKS)
+    panic("initlog: log too small");
+
+  for (uint i = 0; i < 256; i++) {
+    uint c = i;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    crctab[i] = c;
+  }
+
+  log.ab.dev = dev;
+  log.ab.blockno = log.start;
+  if ((log.ab.data = kalloc()) == 0)
+    panic("initlog: kalloc");
+  for (int t = 0; t < NLOGTRANS; t++) {
+    struct logtrans *lt = &log.trans[t];
+    lt->state = LT_FREE;
+    lt->hb.dev = dev;
+    if ((lt->hb.data = kalloc()) == 0)
+      panic("initlog: kalloc");
+    for (int i = 0; i < log.cap; i++) {
+      lt->lb[i].dev = dev;
+      if ((lt->lb[i].data = kalloc()) == 0)
+        panic("initlog: kalloc");
+    }
+  }
   recover_from_log();
+  if (kthread_create(loginstall, "loginstall") < 0)
+    panic("initlog: loginstall");
 }
 
-// Copy committed blocks from log to their home location
+static uint
+crc32(uint crc, uchar *p, int n)
+{
+  while (n-- > 0)
+    crc = crctab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+// crc of a transaction: its block numbers and their contents.
+static uint
+trans_crc(struct logtrans *t)
+{
+  uint crc = crc32(~0, (uchar*)t->lh.block, t->lh.n * sizeof(int));
+
+  for (int i = 0; i < t->lh.n; i++)
+    crc = crc32(crc, t->lb[i].data, BSIZE);
+  return ~crc;
+}
+
+// Read or write the raw buffers bs[0..n-1], sending each run of
+// consecutive blocks as one disk request, and wait for all of them.
 static void
-install_trans(int recovering)
+rawio(struct buf **bs, int n, int write)
 {
-  int tail;
+  int i, j;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && bs[j]->blockno == bs[j-1]->blockno + 1; j++)
+      ;
+    virtio_disk_submitv(bs + i, j - i, write);
   }
+  for (i = 0; i < n; i++)
+    virtio_disk_wait(bs[i]);
 }
 
-// Read the log header from disk into the in-memory log header
+// Copy a committed transaction's blocks to their home locations,
+// in ascending block order so that runs go out together.
 static void
-read_head(void)
+install_trans(struct logtrans *t)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  struct buf **bs = t->io;
+  int i, j;
+
+  for (i = 0; i < t->lh.n; i++) {
+    t->lb[i].blockno = t->lh.block[i];
+    for (j = i; j > 0 && bs[j-1]->blockno > t->lb[i].blockno; j--)
+      bs[j] = bs[j-1];
+    bs[j] = &t->lb[i];
   }
-  brelse(buf);
+  rawio(bs, t->lh.n, 1);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Read or write a transaction's record and blocks at ring
+// position pos, all in one request.
 static void
-write_head(void)
+trans_io(struct logtrans *t, uint pos, int n, int write)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  struct buf **bs = t->io;
+
+  t->hb.blockno = log.start + 1 + pos;
+  bs[0] = &t->hb;
+  for (int i = 0; i < n; i++) {
+    t->lb[i].blockno = log.start + 2 + pos + i;
+    bs[i+1] = &t->lb[i];
   }
-  bwrite(buf);
-  brelse(buf);
+  rawio(bs, n + 1, write);
+}
+
+// Write a transaction's record and blocks to the log.
+// Once both are on disk, the transaction has committed.
+static void
+write_trans(struct logtrans *t)
+{
+  struct logheader *hb = (struct logheader *) (t->hb.data);
+
+  t->lh.magic = LOGMAGIC;
+  t->lh.crc = trans_crc(t);
+  memmove(hb, &t->lh, sizeof(*hb));
+  trans_io(t, t->lsn % log.size, t->lh.n, 1);
+}
+
+// Try to read the transaction with the given seq from ring
+// position pos into t. Return 0 if it is not there or is torn.
+static int
+read_trans(struct logtrans *t, uint pos, uint seq)
+{
+  struct logheader *lh = (struct logheader *) (t->hb.data);
+
+  t->hb.blockno = log.start + 1 + pos;
+  virtio_disk_rw(&t->hb, 0);
+  if (lh->magic != LOGMAGIC || lh->seq != seq)
+    return 0;
+  // a kernel built with a larger cache may have logged more
+  // blocks than log.cap; only the format limits n.
+  if (lh->n <= 0 || lh->n > LOGSIZE || pos + 1 + lh->n > log.size)
+    return 0;
+  memmove(&t->lh, lh, sizeof(t->lh));
+  trans_io(t, pos, t->lh.n, 0);
+  return trans_crc(t) == t->lh.crc;
 }
 
+// Point the anchor at the transaction seq, at ring position pos.
+static void
+write_anchor(uint seq, uint pos)
+{
+  struct loganchor *a = (struct loganchor *) (log.ab.data);
+
+  a->magic = LOGMAGIC;
+  a->seq = seq;
+  a->pos = pos;
+  virtio_disk_rw(&log.ab, 1);
+}
+
+// Replay the chain of complete transactions that starts at
+// the anchor, then move the anchor past them.
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct loganchor *a = (struct loganchor *) (log.ab.data);
+  struct logtrans *t = &log.trans[0];
+  uint seq = 1, pos = 0;
+  int max = log.size - 1 < LOGSIZE ? log.size - 1 : LOGSIZE;
+
+  // room for the largest transaction the log can hold.
+  for (int i = log.cap; i < max; i++) {
+    t->lb[i].dev = log.dev;
+    if ((t->lb[i].data = kalloc()) == 0)
+      panic("recover_from_log: kalloc");
+  }
+  virtio_disk_rw(&log.ab, 0);
+  if (a->magic == LOGMAGIC && a->pos < log.size) {
+    seq = a->seq;
+    pos = a->pos;
+    for (;;) {
+      if (!read_trans(t, pos, seq)) {
+        // a transaction that did not fit before the end of the
+        // ring was written at its start instead.
+        if (pos == 0 || !read_trans(t, 0, seq))
+          break;
+        pos = 0;
+      }
+      install_trans(t);   // copy the blocks home
+      pos = (pos + 1 + t->lh.n) % log.size;
+      seq++;
+    }
+    // later transactions that were in flight may have completed
+    // after the one that broke the chain; never reuse their seqs.
+    seq += NLOGTRANS;
+  }
+  for (int i = log.cap; i < max; i++) {
+    kfree(t->lb[i].data);
+    t->lb[i].data = 0;
+  }
+  write_anchor(seq, pos);
+  log.seq = log.durable = log.installed = seq;
+  log.head = log.itail = log.tail = pos;
 }
 
-// called at the start of each FS system call.
+// called at the start of an FS system call that will log
+// at most n blocks.
 void
-begin_op(void)
+begin_opn(int n)
 {
+  if(n > log.cap)
+    panic("begin_opn");
   acquire(&log.lock);
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.reserved + n > log.cap){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
+      myproc()->logres = n;
       release(&log.lock);
       break;
     }
   }
 }
 
+// called at the start of each FS system call.
+void
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
+// the most blocks one FS system call may reserve.
+int
+log_maxop(void)
+{
+  return log.cap;
+}
+
 // called at the end of each FS system call.
 // commits if this was the last outstanding operation.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  struct logtrans *t = 0;
 
   acquire(&log.lock);
   log.outstanding -= 1;
+  log.reserved -= myproc()->logres;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+  // the transaction's slot may still hold an earlier one being
+  // installed. ops that begin while we wait join the transaction,
+  // and the last of them to end commits it instead.
+  while(log.outstanding == 0 && !log.committing && log.lh.n > 0){
+    if(log.trans[log.seq % NLOGTRANS].state == LT_FREE){
+      t = &log.trans[log.seq % NLOGTRANS];
+      log.committing = 1;
+      break;
+    }
+    sleep(&log, &log.lock);
   }
+  // begin_op() may be waiting for log space,
+  // and decrementing log.outstanding has decreased
+  // the amount of reserved space.
+  wakeup(&log);
   release(&log.lock);
 
-  if(do_commit){
+  if(t){
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+    commit(t);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Wait until every operation that has ended so far is durable:
+// the transaction it joined, and all before it, are in the log.
+// Caller must not be in a transaction.
+void
+log_force(void)
+{
+  acquire(&log.lock);
+  // the transaction being built, if any, will commit as log.seq.
+  uint seq = log.seq + (log.lh.n > 0);
+  while((int)(log.durable - seq) < 0)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+}
+
+// Copy the current transaction into t, find it room in the
+// ring, let new transactions start, then write t to the log.
 static void
-write_log(void)
+commit(struct logtrans *t)
 {
-  int tail;
+  int need, skip;
+
+  // no FS system call is active, so nothing can be changing the
+  // pinned buffers while they are copied.
+  for (int i = 0; i < log.lh.n; i++) {
+    memmove(t->lb[i].data, log.pin[i]->data, BSIZE);
+    t->lh.block[i] = log.lh.block[i];
+    t->pin[i] = log.pin[i];
+  }
+  t->lh.n = log.lh.n;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  acquire(&log.lock);
+  // a transaction must not wrap around the end of the ring.
+  skip = 0;
+  if (log.head % log.size + 1 + t->lh.n > log.size)
+    skip = log.size - log.head % log.size;
+  need = skip + 1 + t->lh.n;
+  while (log.head + need - log.tail > log.size) {
+    log.wantspace = 1;
+    wakeup(&log);
+    sleep(&log, &log.lock);
   }
+  t->lsn = log.head + skip;
+  log.head += need;
+  t->lh.seq = log.seq++;
+  t->state = LT_COMMIT;
+  log.lh.n = 0;
+  log.committing = 0;
+  wakeup(&log);
+  release(&log.lock);
+
+  write_trans(t);   // Write record and blocks -- the real commit
+
+  // report commits in order: a transaction is only replayed
+  // if every one before it is complete too.
+  acquire(&log.lock);
+  while(log.durable != t->lh.seq)
+    sleep(&log, &log.lock);
+  log.durable++;
+  log.ncommit++;
+  log.nlogged += t->lh.n;
+  t->state = LT_INSTALL;
+  wakeup(&log);
+  release(&log.lock);
 }
 
+// Kernel thread that installs committed transactions, oldest
+// first, and frees their slots for reuse. When a commit is
+// short of ring space, it moves the anchor past the installed
+// transactions.
 static void
-commit()
+loginstall(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  for(;;){
+    struct logtrans *t = &log.trans[log.installed % NLOGTRANS];
+    uint seq;
+    uint64 lsn;
+
+    acquire(&log.lock);
+    while(t->state != LT_INSTALL && !(log.wantspace && log.itail != log.tail))
+      sleep(&log, &log.lock);
+    if(t->state != LT_INSTALL){
+      seq = log.installed;
+      lsn = log.itail;
+      release(&log.lock);
+
+      write_anchor(seq, lsn % log.size);
+
+      acquire(&log.lock);
+      log.tail = lsn;
+      log.wantspace = 0;
+      log.nanchor++;
+      wakeup(&log);
+      release(&log.lock);
+      continue;
+    }
+    release(&log.lock);
+
+    install_trans(t);  // Now install writes to home locations
+    for (int i = 0; i < t->lh.n; i++)
+      bunpin(t->pin[i]);
+
+    acquire(&log.lock);
+    log.installed++;
+    log.itail = t->lsn + 1 + t->lh.n;
+    t->state = LT_FREE;
+    wakeup(&log);
+    release(&log.lock);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// commit()/write_trans() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -217,7 +523,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.cap)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -229,8 +535,21 @@ log_write(struct buf *b)
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
+    log.pin[i] = b;
     log.lh.n++;
   }
   release(&log.lock);
 }
 
+// report log statistics through the stats device.
+int
+statslog(char *buf, int sz)
+{
+  int n;
+
+  acquire(&log.lock);
+  n = snprintf(buf, sz, "--- log: transaction max %d commits %d blocks %d anchor writes %d\n",
+               log.cap, (int)log.ncommit, (int)log.nlogged, (int)log.nanchor);
+  release(&log.lock);
+  return n;
+}
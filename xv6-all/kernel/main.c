@@ -29,6 +29,7 @@ main()
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode table
+    dcacheinit();    // name cache
     fileinit();      // file table
     virtio_disk_init(); // emulated hard disk
     procfsinit();    // procfs file system
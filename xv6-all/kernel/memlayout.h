@@ -47,9 +47,9 @@
 // for use by the kernel and user pages
 // from physical address 0x80000000 to PHYSTOP.
 #define KERNBASE 0x80000000L
-#define PHYSTOP (KERNBASE + 128*1024*1024)
-#define PHYSTOP_INCLUDESUPPG (PHYSTOP + 4*1024*1024)
-#define IS_SUPPG(pa) (pa >= PHYSTOP || pa == PLIC)
+#define PHYSTOP (KERNBASE + 132*1024*1024)
+// superpages come from the same memory as pages; see kalloc_suppage().
+#define IS_SUPPG(pa) ((pa) == PLIC || kis_suppage(pa))
 
 // map the trampoline page to the highest address,
 // in both user and kernel space.
@@ -48,7 +48,7 @@ int vma_handle(struct proc *p, uint64 va) {
   va = PGROUNDDOWN(va);
   pte_t *pte = walk(p->pagetable, va, 0);
   if (pte && (*pte & PTE_PG)) {
-    return pagein(pte, &p->tshared->slock);
+    return pagein(p->pagetable, va, &p->tshared->tlock);
   }
   int ret = 0;
   acquiresleep(&p->tshared->slock);
@@ -74,18 +74,18 @@ int vma_handle(struct proc *p, uint64 va) {
         if ((tmp = kalloc_suppage()) == 0) {
           goto err;
         }
+        memset(tmp, 0, SUPPGSIZE);
         ret = 1;
         pgsize = SUPPGSIZE;
         va = SUPPGROUNDDOWN(va);
       } else {
         release(&p->tshared->tlock);
-        if ((tmp = kalloc()) == 0) {
+        if ((tmp = kalloc_zeroed()) == 0) {
           acquire(&p->tshared->tlock);
           goto err;
         }
         acquire(&p->tshared->tlock);
       }
-      memset(tmp, 0, pgsize);
       mem = (uint64) tmp;
     }
 
@@ -135,6 +135,8 @@ int vma_handle(struct proc *p, uint64 va) {
       acquire(&p->tshared->tlock);
       goto err;
     }
+    if (private)
+      rmap_add(p->pagetable, walk(p->pagetable, va, 0));
 success:
     releasesleep(&p->tshared->slock);  
     return ret;  // Page fault handled successfully
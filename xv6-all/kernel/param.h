@@ -4,20 +4,36 @@
 #define NPROC        64  // maximum number of processes (speedsup bigfile)
 #endif
 #define NCPU          8  // maximum number of CPUs
-#define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NOFILE       16  // open files per process before its table grows
+#define MAXOFILE    512  // open files per process: a page of pointers
+#define NINODE       50  // minimum number of in-memory i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define MAXOPBLOCKS  12  // max # of blocks any FS op writes
+#define LOGSIZE     254  // max data blocks in one log transaction
+#define NLOGTRANS     2  // transactions committing or installing at once
+#ifndef LOGBLOCKS
+#define LOGBLOCKS   128  // mkfs: blocks in the on-disk log; "make LOGBLOCKS=n" overrides
+#endif
+#ifndef NBUF
+#define NBUF        256  // size of disk block cache; "make NBUF=n" overrides
+#endif
+#define NBRUN         8  // max blocks in one bread_multi()
+#define NWBPAGE     512  // max O_WRBACK pages not yet on disk
+#define WBDELAY      30  // ticks between flusher passes
+#define RECLAIM_LOW  64  // free pages below which pages are swapped out...
+#define RECLAIM_HIGH 256 // ...until this many are free
+#define RECLAIM_BATCH 16 // pages swapped out at a time
+#define RECLAIM_SCAN 512 // pages the reclaim thread ages per tick
+#define SWAP_RA       8  // window of pages read around a swap fault
+#define ZSWAP_POOL 1024  // max pages holding compressed swapped-out pages
 
-#define SWAP_SPACE_BLOCKS 1024  // size of swap region in blocks
+#ifndef SWAP_SPACE_BLOCKS
+#define SWAP_SPACE_BLOCKS 2048  // mkfs: size of swap region in blocks; "make SWAPBLOCKS=n" overrides
+#endif
 // (after uprog increase, to pass bigwrite test ,we need more file space)
 #define FSSIZE       (40000 + SWAP_SPACE_BLOCKS)  // size of file system in blocks 
-#define NBUFBUC      13  // size of block cache hash table bucket
 #define MAXPATH      128   // maximum file path name
 
 
@@ -20,6 +20,7 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadstart(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
@@ -128,6 +129,8 @@ allocproc(int isthread)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->ofile = p->ofile0;
+  p->nofile = NOFILE;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -206,6 +209,11 @@ freeproc(struct proc *p)
   p->tstack = 0;
   p->isthread = 0;
   p->trap_va = 0;
+  p->kfn = 0;
+  if(p->nofile > NOFILE)
+    kfree((void*)p->ofile);
+  p->ofile = p->ofile0;
+  p->nofile = NOFILE;
   p->state = UNUSED;
   p->tickspassed = 0;
   p->alarminterval = 0;
@@ -324,6 +332,42 @@ userinit(void)
   release(&p->lock);
 }
 
+// Start a kernel thread running fn(), for kernel services that
+// must do slow work (such as disk I/O) off the path of the system
+// call that asked for it. A kernel thread has no user memory,
+// runs until the system halts, and is skipped by the pager.
+int
+kthread_create(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  // allocproc(1) skips the user page table and usyscall page.
+  if((p = allocproc(1)) == 0)
+    return -1;
+  p->isthread = 0;
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadstart;
+  initlock(&p->tshared->tlock, "tlock");
+  initsleeplock(&p->tshared->slock, "slock");
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+  return 0;
+}
+
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadstart.
+static void
+kthreadstart(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn();
+  panic("kthread returned");
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -365,12 +409,17 @@ fork(void)
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->tshared->sz) < 0){
+  if(uvmcopy(p->pagetable, np->pagetable, p->tshared->sz, &p->tshared->tlock) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->tshared->sz = p->tshared->sz;
+  if(fdgrow(np, p->nofile) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
 
   // Copy signal status from parent to child (exclude pending status)
   np->sa_mask = p->sa_mask;
@@ -385,7 +434,7 @@ fork(void)
   np->trapframe->a0 = 0;
 
   // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
+  for(i = 0; i < p->nofile; i++)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
@@ -459,7 +508,7 @@ clone(void(*fcn)(void*, void*), void *arg1, void *arg2, void *stack)
 
   // find a address to remap TRAPFRAME page
   // it is important since TRAPFRAME page should not be shared across threads
-  uint64 trap_va = PHYSTOP_INCLUDESUPPG;
+  uint64 trap_va = PHYSTOP;
   for(; trap_va < USYSCALL ; trap_va += PGSIZE) {
     if (kwalkaddr(np->pagetable, trap_va) == 0) {
       np->trap_va = trap_va;
@@ -473,7 +522,9 @@ clone(void(*fcn)(void*, void*), void *arg1, void *arg2, void *stack)
 
 
   // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
+  if(fdgrow(np, p->nofile) < 0)
+    goto err;
+  for(i = 0; i < p->nofile; i++)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
@@ -490,6 +541,17 @@ err:
 
 }
 
+// Does p have threads, which share its page table? Only p
+// creates them, so p cannot gain one while it is in the kernel.
+int
+threaded(struct proc *p)
+{
+  for(struct proc *t = proc; t < &proc[NPROC]; t++)
+    if(t != p && t->isthread && t->state != UNUSED && t->pagetable == p->pagetable)
+      return 1;
+  return 0;
+}
+
 // when a process (not a thread) calls exit, all threads of this process should be exit
 void 
 tpkill(struct proc *curproc) 
@@ -559,7 +621,7 @@ exit(int status)
     panic("init exiting");
 
   // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
+  for(int fd = 0; fd < p->nofile; fd++){
     if(p->ofile[fd]){
       struct file *f = p->ofile[fd];
       fileclose(f);
@@ -765,9 +827,11 @@ scheduler(void)
     // processes are waiting.
     intr_on();
 
+    int found = 0;
     for(p = proc; p < &proc[NPROC]; p++) {
       acquire(&p->lock);
       if(p->state == RUNNABLE) {
+        found = 1;
         // Switch to chosen process.  It is the process's job
         // to release its lock and then reacquire it
         // before jumping back to us.
@@ -781,6 +845,9 @@ scheduler(void)
       }
       release(&p->lock);
     }
+    // nothing to run: get pages ready for kalloc_zeroed().
+    if(!found)
+      kzero_idle();
   }
 }
 
@@ -1001,85 +1068,53 @@ procdump(void)
   }
 }
 
-uint64
-find_swapping_page(int *refcnt, struct spinlock* memlock)
+// is pt the page table of init or the shell, whose pages must
+// stay in memory?
+int
+pagetable_pinned(pagetable_t pt)
 {
-begin:  
-  struct proc *p;
-  pte_t *pte, *ret = 0;
-  uint8 minage = 255;
-  uint64 res;
-  
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if((p->state == RUNNING || p->state == RUNNABLE || p->state == SLEEPING) && (p->pid > 2))
-    {
-      acquire(&p->tshared->tlock);
-      acquire(memlock);
-      for(int a = 0; a < p->tshared->sz; a += PGSIZE){
-        if((pte = walk(p->pagetable, a, 0)) == 0)
-          continue;
-        if((*pte & PTE_V) == 0)
-          continue;
-        if(*pte & PTE_COW)
-          continue;
-        if(PTE_FLAGS(*pte) == PTE_V)
-          panic("find_nfup_proc: not a leaf");
-        
-        uint8 age = pageage(pte);
-        if (age < minage && refcnt[COW_REFIDX(PTE2PA(*pte))] == 1) {
-          
-          minage = age;
-          ret = pte;
-        }
-        if (minage == 0) break;
-      }
-      release(memlock);
-      release(&p->tshared->tlock);
-    }
-    release(&p->lock);
-    if (minage == 0) break;
-  }
-  
-  if (ret == 0) {
-    return 0;
-  }
-  acquire(memlock);
-  int idx = COW_REFIDX(PTE2PA(*ret));
-  int old_ref_cnt = refcnt[idx];
-  if (old_ref_cnt != 1) {
-    panic("find_swapping_page 2");
-  }
-  release(memlock);
-  res = pageout(ret);
-  if (res < 0) goto begin;
-  if (res > 0) {
-    acquire(memlock);
-    refcnt[idx] = 0;
-    release(memlock);
+  return (initproc && pt == initproc->pagetable) || (shproc && pt == shproc->pagetable);
+}
+
+// The tlock of the process whose page table is pt, or 0 if pt is
+// not a running process's (exec's new one, say). For the swap
+// code, which holds rmap.lock with a mapping in pt on record: the
+// process can't have freed its page table, or the trapframe that
+// holds the tlock, until that mapping is gone.
+struct spinlock *
+pagetable_tlock(pagetable_t pt)
+{
+  for(struct proc *p = proc; p < &proc[NPROC]; p++){
+    struct threadshared *ts = p->tshared;
+    if(p->state != UNUSED && p->pagetable == pt && ts)
+      return &ts->tlock;
   }
-  return res;
+  return 0;
 }
 
-void update_page_age()
+// Wait until no hart can still use a TLB entry for a PTE that the
+// caller changed in one of the page tables pts[0..n-1]. A hart
+// flushes its TLB each time it enters or leaves user space, so
+// only harts now in user space with one of those page tables
+// need be waited for, until they next trap (at least once a tick).
+void
+tlb_shootdown(pagetable_t *pts, int n)
 {
-  struct proc *p;
-  pte_t *pte;
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if((p->state == RUNNING || p->state == RUNNABLE || p->state == SLEEPING) && (p->pid > 2))
-    {
-      acquire(&p->tshared->tlock); 
-      for(int a = 0; a < p->tshared->sz; a += PGSIZE){
-        if((pte = walk(p->pagetable, a, 0)) == 0)
-          continue;
-        if((*pte & PTE_V) == 0)
-          continue;  
-        pageage(pte);
-      }
-      release(&p->tshared->tlock);
+  uint seen[NCPU];
+
+  __sync_synchronize();
+  for(int i = 0; i < NCPU; i++)
+    seen[i] = __atomic_load_n(&cpus[i].utraps, __ATOMIC_ACQUIRE);
+  for(int i = 0; i < NCPU; i++){
+    for(;;){
+      pagetable_t upt = __atomic_load_n(&cpus[i].upt, __ATOMIC_ACQUIRE);
+      int k;
+      for(k = 0; k < n && pts[k] != upt; k++)
+        ;
+      if(upt == 0 || k == n || __atomic_load_n(&cpus[i].utraps, __ATOMIC_ACQUIRE) != seen[i])
+        break;
+      yield();
     }
-    release(&p->lock);
   }
 }
 
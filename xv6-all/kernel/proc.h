@@ -24,6 +24,8 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  pagetable_t upt;            // The user page table while in user space, or 0.
+  uint utraps;                // Traps from user space, for tlb_shootdown().
 };
 
 extern struct cpu cpus[NCPU];
@@ -133,7 +135,9 @@ struct proc {
   struct trapframe *trapframe; // data page for trampoline.S
   struct usyscall *usyscall;   
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
+  struct file **ofile;         // Open files
+  int nofile;                  // Size of ofile[]
+  struct file *ofile0[NOFILE]; // ofile[] until it has to grow
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
   int trace_arg;               // the argument of sys_trace
@@ -149,6 +153,8 @@ struct proc {
   uint64 trap_va;              // trapframe va for threads
   int isthread;
   uint64 tstack;
+  void (*kfn)(void);           // body of a kernel thread, else 0
+  int logres;                  // log blocks reserved by begin_opn()
 };
 
 struct usyscall {
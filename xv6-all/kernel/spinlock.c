@@ -96,6 +96,25 @@ acquire(struct spinlock *lk)
   lk->cpu = mycpu();
 }
 
+// Acquire the lock if that can be done without spinning, for
+// code that holds locks meant to be taken after it.
+// Returns 1 if it did.
+int
+tryacquire(struct spinlock *lk)
+{
+  push_off();
+  if(holding(lk) || __sync_lock_test_and_set(&lk->locked, 1) != 0){
+    pop_off();
+    return 0;
+  }
+#ifdef LAB_LOCK
+  __sync_fetch_and_add(&(lk->n), 1);
+#endif
+  __sync_synchronize();
+  lk->cpu = mycpu();
+  return 1;
+}
+
 // Release the lock.
 void
 release(struct spinlock *lk)
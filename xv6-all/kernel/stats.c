@@ -19,6 +19,12 @@ static struct {
 
 int statscopyin(char*, int);
 int statslock(char*, int);
+int statsdisk(char*, int);
+int statsbio(char*, int);
+int statslog(char*, int);
+int statsdcache(char*, int);
+int statswb(char*, int);
+int statsswap(char*, int);
   
 int
 statswrite(int user_src, uint64 src, int n)
@@ -39,6 +45,12 @@ statsread(struct inode *ip, int user_dst, uint64 dst, int off, int n)
 #endif
 #ifdef LAB_LOCK
     stats.sz = statslock(stats.buf, BUFSZ);
+    stats.sz += statsdisk(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += statsbio(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += statslog(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += statsdcache(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += statswb(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += statsswap(stats.buf+stats.sz, BUFSZ-stats.sz);
 #endif
   }
   m = stats.sz - stats.off;
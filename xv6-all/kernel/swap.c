@@ -10,118 +10,670 @@
 #include "buf.h"
 #include "memlayout.h"
 
-int swappg_refcnt[SWAP_SPACE_BLOCKS];
-uint8 pg_age[PG_REFIDX(PHYSTOP)];
-struct spinlock swaplock;
-uint32 swapstart;
+// Swap space.
+//
+// The nswap blocks after the free-block bitmap hold swapped-out
+// pages, one page per block. A bitmap records which slots are in
+// use, and ref[] how many PTEs refer to each (fork shares a
+// swapped-out page like any other). Slots are handed out in
+// contiguous clusters, next-fit from a cursor, so that a batch of
+// pages is written with a single disk request. Pages go straight
+// between memory and disk, not through the buffer cache.
+//
+// A fault reads its page into the swap cache and, at the same
+// time, starts reads of the swapped-out pages around it that were
+// written in the same cluster. A later fault on one of those finds
+// it in the cache, read or on its way. Faults take only the
+// process's tlock, and only to look at and update PTEs; the cache
+// entry for a slot stands in for a lock on the page.
+//
+// A page is taken out of its page tables before it is copied to
+// swap, and the TLBs flushed, so that nothing can change it during
+// the copy; a fault on one of the slots being written waits until
+// the copy is done.
+
+#define NSWAPCACHE 32
+
+struct scent {
+  int slot;              // -1 if the page is not for any slot
+  uint64 pa;             // 0 if the entry is free
+  uint stamp;            // when it was filled, for eviction
+  struct buf b;          // b.disk while the read is in flight
+};
+
+struct {
+  struct spinlock lock;
+  uint start;            // first block
+  uint n;                // slots, a multiple of 64
+  uint nfree;
+  uint cursor;           // where the next search starts
+  uint64 *map;           // bit set if the slot is in use
+  ushort *ref;           // PTEs that refer to each slot
+  uint outs, ins;        // pages written and read
+  uint writes;           // disk requests for outs
+  uint spills;           // pages moved from zswap to disk
+  struct scent cache[NSWAPCACHE];
+  uint stamp;
+  uint rareads, hits;    // pages read around, faults the cache served
+  uint wstart, wend;     // slots being written, which faults wait for
+} swap;
+
+uint8 pg_age[PG_REFIDX(PHYSTOP)];  // protected by swap.lock
+
+// Buffers for swap-out, which the reclaim thread and kalloc()
+// take turns using.
+struct {
+  struct sleeplock lock;
+  struct buf buf[RECLAIM_BATCH];
+  struct buf spill;      // for a page going from zswap to disk
+  char spillpage[PGSIZE];
+  pagetable_t pt[NPROC]; // page tables the batch was taken out of
+  int npt;
+} swapio;
+
+// Page reclaim.
+//
+// The kswapd thread keeps the number of free pages between
+// RECLAIM_LOW and RECLAIM_HIGH. Each tick it ages up to
+// RECLAIM_SCAN pages with pageage(), moving a clock hand through
+// physical memory, and puts pages that have gone unused for the
+// last eight looks on the inactive list. When free memory is low
+// it swaps out inactive pages that are still unused,
+// RECLAIM_BATCH at a time, so that kalloc() seldom has to.
+// The reverse map (see kalloc.c) finds every PTE that maps a
+// page, so a page shared copy-on-write is swapped out of all the
+// page tables that share it at once.
+
+#define NINACTIVE 512
+
+struct {
+  struct spinlock lock;
+  uint64 pa[NINACTIVE];
+  int head;              // oldest
+  int n;
+} inactive;
+
+uint64 hand;             // next page clockscan() looks at, under inactive.lock
+
+static void kswapd(void);
 
 void initswap(int dev, struct superblock *sb) {
-  for (int i = 0; i < SWAP_SPACE_BLOCKS; i++) {
-    swappg_refcnt[i] = 0;
-  }
-  initlock(&swaplock, "swap");
+  int order = 0;
+
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swapio.lock, "swapio");
   for (int i = 0; i < PG_REFIDX(PHYSTOP); i++) pg_age[i] = 0;
-  swapstart = sb->swapstart;
+  swap.start = sb->swapstart;
+  swap.n = sb->nswap & ~63;
+  swap.nfree = swap.n;
+  if (swap.n > 0) {
+    uint sz = swap.n / 8 + swap.n * sizeof(ushort);
+    while ((PGSIZE << order) < sz)
+      order++;
+    if ((swap.map = kalloc_pages(order)) == 0)
+      panic("initswap");
+    memset(swap.map, 0, sz);
+    swap.ref = (ushort *)(swap.map + swap.n / 64);
+  }
+  for (int i = 0; i < NSWAPCACHE; i++)
+    swap.cache[i].slot = -1;
+  zswapinit(swap.n);
+  initlock(&inactive.lock, "inactive");
+  hand = KERNBASE;
+  if (kthread_create(kswapd, "kswapd") < 0)
+    panic("initswap: kswapd");
+}
+
+#define SLOTUSED(i) (swap.map[(i) / 64] & (1ULL << ((i) % 64)))
+#define SLOTBUSY(i) ((i) >= swap.wstart && (i) < swap.wend)
+
+// Allocate a run of up to want free slots, each with one
+// reference: the first run that long after the cursor, or else
+// the longest there is. Returns the first slot and sets *got to
+// the length, or returns -1 if swap is full.
+static int
+slotalloc(int want, int *got)
+{
+  int start = 0, run = 0, best = -1, bestlen = 0;
+
+  acquire(&swap.lock);
+  for (uint k = 0; k < swap.n && swap.nfree > 0 && bestlen < want; k++) {
+    uint i = (swap.cursor + k) % swap.n;
+    if (i == 0)
+      run = 0;      // runs don't wrap around
+    if (i % 64 == 0 && swap.map[i / 64] == ~0ULL) {
+      k += 63;      // a full word
+      run = 0;
+      continue;
+    }
+    if (SLOTUSED(i)) {
+      run = 0;
+      continue;
+    }
+    if (run++ == 0)
+      start = i;
+    if (run > bestlen) {
+      best = start;
+      bestlen = run;
+    }
+  }
+  for (int i = best; i < best + bestlen; i++) {
+    swap.map[i / 64] |= 1ULL << (i % 64);
+    swap.ref[i] = 1;
+  }
+  swap.nfree -= bestlen;
+  if (best >= 0)
+    swap.cursor = (best + bestlen) % swap.n;
+  release(&swap.lock);
+  *got = bestlen;
+  return best;
+}
+
+// Set slot i's reference count, freeing it if that is 0.
+// Caller holds swap.lock.
+static void
+slotset(int i, int ref)
+{
+  if (ref < 0 || !SLOTUSED(i))
+    panic("slotset");
+  swap.ref[i] = ref;
+  if (ref == 0) {
+    swap.map[i / 64] &= ~(1ULL << (i % 64));
+    swap.nfree++;
+    zdrop(i);
+    // a page read ahead for the slot is no good any more.
+    for (struct scent *e = swap.cache; e < swap.cache + NSWAPCACHE; e++) {
+      if (e->slot == i) {
+        e->slot = -1;
+        if (!e->b.disk) {
+          kfree((void *)e->pa);
+          e->pa = 0;
+        }
+      }
+    }
+  }
+}
+
+// The cache entry for slot, or 0. Caller holds swap.lock.
+static struct scent *
+scfind(int slot)
+{
+  for (struct scent *e = swap.cache; e < swap.cache + NSWAPCACHE; e++)
+    if (e->slot == slot)
+      return e;
+  return 0;
+}
+
+// Take a cache entry for reading slot into the page at pa: a free
+// one, or else the one holding the page read longest ago. Sets
+// *old to a page the caller must kfree(). Returns 0 if every entry
+// is being read. Caller holds swap.lock, and submits the read.
+static struct scent *
+scalloc(int slot, uint64 pa, uint64 *old)
+{
+  struct scent *e, *v = 0;
+
+  *old = 0;
+  for (e = swap.cache; e < swap.cache + NSWAPCACHE; e++) {
+    if (e->b.disk)
+      continue;
+    if (e->pa == 0) {
+      v = e;
+      break;
+    }
+    if (v == 0 || (e->slot < 0 && v->slot >= 0) ||
+        ((e->slot < 0) == (v->slot < 0) && e->stamp < v->stamp))
+      v = e;
+  }
+  if (v == 0)
+    return 0;
+  *old = v->pa;
+  v->slot = slot;
+  v->pa = pa;
+  v->stamp = swap.stamp++;
+  v->b.dev = ROOTDEV;
+  v->b.blockno = swap.start + slot;
+  v->b.data = (uchar *)pa;
+  v->b.flags = 0;
+  v->b.disk = 1;  // in flight from now, so nobody takes the page
+  return v;
+}
+
+// Free the pages in the cache that no fault is waiting for.
+// Returns the number freed.
+static int
+scdrop(void)
+{
+  int n = 0;
+
+  acquire(&swap.lock);
+  for (struct scent *e = swap.cache; e < swap.cache + NSWAPCACHE; e++) {
+    if (e->pa && !e->b.disk) {
+      kfree((void *)e->pa);
+      e->pa = 0;
+      e->slot = -1;
+      n++;
+    }
+  }
+  release(&swap.lock);
+  return n;
 }
 
-uint8 pageage(pte_t *pte) {
-  uint64 pa = PTE2PA(*pte);
-  acquire(&swaplock);
-  
+// Age the page at pa, shifting in whether it was used since the
+// last look. Returns the age, or -1 if the page can't be swapped.
+static int
+pageage(uint64 pa) {
+  int used = rmap_referenced(pa);
+  if (used < 0)
+    return -1;
+  acquire(&swap.lock);
   uint8 age = pg_age[PG_REFIDX(pa)];
   age >>= 1;
-  if (*pte & PTE_A) {
+  if (used)
     age |= (1 << 7);
-    *pte &= (~PTE_A);
-  }
   pg_age[PG_REFIDX(pa)] = age;
-  release(&swaplock);
+  release(&swap.lock);
   return age;
 }
 
-int swappageclone(pte_t *pte, pagetable_t new, int va) {
-  int idx = (int)PTE2IDX(*pte);
-  acquire(&swaplock);
-  ++swappg_refcnt[idx];
-  release(&swaplock);
-  if(mappages(new, va, PGSIZE, PTE2PA(*pte), PTE_FLAGS(*pte)) != 0)
+// Copy the swapped-out PTE pte into new at va, for fork, which
+// has taken a reference to its slot with swapincget().
+int swappageclone(pte_t pte, pagetable_t new, uint64 va) {
+  pte_t *npte;
+
+  if(mappages(new, va, PGSIZE, PTE2PA(pte), PTE_FLAGS(pte)) != 0){
+    swapdecget((int)PTE2IDX(pte));
     return -1;
-  pte = walk(new, va, 0);
-  *pte &= (~PTE_V);
+  }
+  npte = walk(new, va, 0);
+  *npte &= (~PTE_V);
   return 0;
 }
 
-uint64 pageout(pte_t *pte) {
-  uint64 pa = 0;
-  acquire(&swaplock);
-  if(*pte & PTE_V) {
-    for (int i = 0; i < SWAP_SPACE_BLOCKS; i++) {
-      if (swappg_refcnt[i] == 0) {
-        pa = PTE2PA(*pte);
-        swappg_refcnt[i] = 1;
-        *pte = PTE_PGOUT(i, PTE_FLAGS(*pte));
-        release(&swaplock);
-
-        struct buf *buf = bread(ROOTDEV, swapstart+i);
-        memmove(buf->data, (void *)pa, PGSIZE);
-        bwrite(buf);
-        brelse(buf);
-        acquire(&swaplock);
-        break;
+// Move the oldest page in zswap to disk, to make room.
+// Returns 0 if it did, -1 if zswap is empty.
+// Caller holds swapio.lock.
+static int
+zevict(void)
+{
+  int slot = zspill(swap.cursor, (uint64)swapio.spillpage);
+
+  if (slot < 0)
+    return -1;
+  swapio.spill.dev = ROOTDEV;
+  swapio.spill.blockno = swap.start + slot;
+  swapio.spill.data = (uchar *)swapio.spillpage;
+  swapio.spill.flags = 0;
+  virtio_disk_rw(&swapio.spill, 1);
+  zspilled(slot);
+  acquire(&swap.lock);
+  swap.writes++;
+  swap.spills++;
+  release(&swap.lock);
+  return 0;
+}
+
+// Try to keep the page at pa, for slot, compressed in memory,
+// spilling older pages to disk if zswap is full. Returns 1 if
+// it is there. Caller holds swapio.lock.
+static int
+zput(int slot, uint64 pa)
+{
+  int r;
+
+  for (int tries = 0; (r = zstore(slot, pa)) < 0 && tries < 4; tries++)
+    if (zevict() < 0)
+      break;
+  return r > 0;
+}
+
+// Swap out the n pages pa[0..n-1], each pinned with rmap_pin(),
+// those still unused: take them out of their page tables, flush
+// the TLBs, and only then write them to swap. Drops the pins.
+// Returns the number of pages freed, or -1 if swap is full.
+static int
+swapoutv(uint64 *pa, int n) {
+  struct buf *bs[RECLAIM_BATCH];
+  int nref[RECLAIM_BATCH];
+  int start, len, freed = 0;
+
+  if (n > RECLAIM_BATCH)
+    panic("swapoutv");
+  acquiresleep(&swapio.lock);
+  for (int j = 0; j < n; j += len) {
+    if ((start = slotalloc(n - j, &len)) < 0) {
+      releasesleep(&swapio.lock);
+      for (; j < n; j++)
+        kfree((void *)pa[j]);
+      return freed > 0 ? freed : -1;
+    }
+    // each slot keeps the reference slotalloc() gave it until the
+    // copy is done, and one for each PTE that will refer to it, set
+    // now, before the PTEs can be seen (and unmapped).
+    acquire(&swap.lock);
+    swap.wstart = start;
+    swap.wend = start + len;
+    for (int k = 0; k < len; k++) {
+      nref[k] = krefcnt(pa[j + k]) - 1;  // less the pin
+      slotset(start + k, 1 + (nref[k] > 0 ? nref[k] : 0));
+    }
+    release(&swap.lock);
+    swapio.npt = 0;
+    for (int k = 0; k < len; k++)
+      nref[k] = rmap_swapout(pa[j + k], start + k, nref[k], swapio.pt, &swapio.npt);
+    tlb_shootdown(swapio.pt, swapio.npt);
+
+    // compress what we can into zswap, and write the rest to
+    // disk, a run of consecutive slots at a time.
+    int nb = 0;
+    for (int k = 0; k < len; k++) {
+      if (nref[k] == 0 || zput(start + k, pa[j + k]))
+        continue;
+      struct buf *b = &swapio.buf[nb];
+      b->dev = ROOTDEV;
+      b->blockno = swap.start + start + k;
+      b->data = (uchar *)pa[j + k];
+      b->flags = 0;
+      bs[nb++] = b;
+    }
+    for (int k = 0, m; k < nb; k += m) {
+      for (m = 1; k + m < nb && bs[k + m]->blockno == bs[k]->blockno + m; m++)
+        ;
+      virtio_disk_submitv(bs + k, m, 1);
+      acquire(&swap.lock);
+      swap.writes++;
+      release(&swap.lock);
+    }
+    for (int k = 0; k < nb; k++)
+      virtio_disk_wait(bs[k]);
+
+    acquire(&swap.lock);
+    swap.wstart = swap.wend = 0;
+    wakeup(&swap.wstart);
+    for (int k = 0; k < len; k++) {
+      // drop the slot's own reference; a page still in use was
+      // never mapped to it, so that frees the slot.
+      slotset(start + k, nref[k] > 0 ? swap.ref[start + k] - 1 : 0);
+      if (nref[k] > 0) {
+        swap.outs++;
+        freed++;
       }
     }
-  } else pa = -1; // another thread already page out this pte's pa
-  release(&swaplock);
-  return pa;
+    release(&swap.lock);
+    for (int k = 0; k < len; k++)
+      kfree((void *)pa[j + k]);
+  }
+  releasesleep(&swapio.lock);
+  return freed;
 }
 
-int pagein(pte_t *pte, struct sleeplock *slock) {
-  acquiresleep(slock);
-  if (!(*pte & PTE_PG)) {
-    releasesleep(slock);
-    // page in already success
-    return 0;
+// Start reading the swapped-out pages in the SWAP_RA-page window
+// around va whose slots are near slot, the one va is in: they were
+// most likely written in the same cluster.
+static void
+readaround(pagetable_t pagetable, uint64 va, int slot, struct spinlock *tlock)
+{
+  uint64 base = va - va % (SWAP_RA * PGSIZE), mem, old;
+  int slots[SWAP_RA], n = 0;
+  struct scent *e;
+  pte_t *pte;
+
+  acquire(tlock);
+  for (uint64 a = base; a < base + SWAP_RA * PGSIZE; a += PGSIZE) {
+    if (a == va || (pte = walk(pagetable, a, 0)) == 0 || !(*pte & PTE_PG))
+      continue;
+    int i = (int)PTE2IDX(*pte);
+    if (i > slot - SWAP_RA && i < slot + SWAP_RA && !zhas(i))
+      slots[n++] = i;
   }
-  int idx = (int)PTE2IDX(*pte);
-  uint64 mem = (uint64)kalloc();
-  if (mem == 0) {
-    releasesleep(slock);
-    return -1;
+  release(tlock);
+
+  for (int k = 0; k < n; k++) {
+    if (kfreepages() < RECLAIM_LOW || (mem = (uint64)kalloc()) == 0)
+      break;
+    acquire(&swap.lock);
+    e = 0;
+    if (scfind(slots[k]) == 0 && SLOTUSED(slots[k]) && !SLOTBUSY(slots[k]) &&
+        (e = scalloc(slots[k], mem, &old)) != 0)
+      swap.rareads++;
+    release(&swap.lock);
+    if (e == 0) {
+      kfree((void *)mem);
+      continue;
+    }
+    if (old)
+      kfree((void *)old);
+    virtio_disk_submit(&e->b, 0);
   }
+}
 
-  acquire(&swaplock);
-  if(swappg_refcnt[idx] <= 0) panic("pagein");
-  swappg_refcnt[idx]--;
-  // printf("pagein %d\n", idx);
-  release(&swaplock);
-
-  struct buf *buf = bread(ROOTDEV, swapstart + idx);
-  memmove((char *)mem, buf->data, PGSIZE);
-  *pte = PTE_PGIN(mem, PTE_FLAGS(*pte));
-  brelse(buf);
-  releasesleep(slock);
-  return 0;
+// Bring back the page at va, which was swapped out, through the
+// swap cache. Returns 0 if the page is in (perhaps brought in by
+// another thread), -1 if out of memory.
+int pagein(pagetable_t pagetable, uint64 va, struct spinlock *tlock) {
+  uint64 mem = 0, pa, old;
+  struct scent *e;
+  pte_t *pte;
+  int slot, mine;
+
+  for (;;) {
+    acquire(tlock);
+    pte = walk(pagetable, va, 0);
+    if (pte == 0 || !(*pte & PTE_PG)) {
+      release(tlock);
+      if (mem)
+        kfree((void *)mem);
+      return 0;
+    }
+    slot = (int)PTE2IDX(*pte);
+    release(tlock);
+
+    acquire(&swap.lock);
+    if (SLOTBUSY(slot)) {
+      // still being written out.
+      sleep(&swap.wstart, &swap.lock);
+      release(&swap.lock);
+      continue;
+    }
+    release(&swap.lock);
+    if (mem == 0 && (mem = (uint64)kalloc()) == 0)
+      return -1;
+    if (zload(slot, mem)) {
+      pa = mem;
+      mem = 0;
+      acquire(&swap.lock);
+      swap.ins++;
+      release(&swap.lock);
+      goto install;
+    }
+    acquire(&swap.lock);
+    old = 0;
+    mine = 0;
+    if ((e = scfind(slot)) == 0 && (e = scalloc(slot, mem, &old)) != 0) {
+      mem = 0;
+      mine = 1;
+    }
+    release(&swap.lock);
+    if (old)
+      kfree((void *)old);
+    if (e == 0) {
+      // every entry is being read; wait for one.
+      virtio_disk_wait(&swap.cache[0].b);
+      continue;
+    }
+    if (mine) {
+      virtio_disk_submit(&e->b, 0);
+      readaround(pagetable, va, slot, tlock);
+    }
+    virtio_disk_wait(&e->b);
+
+    acquire(&swap.lock);
+    if (e->slot != slot || e->b.disk) {
+      // taken by another thread, or the slot was freed.
+      release(&swap.lock);
+      continue;
+    }
+    pa = e->pa;
+    e->slot = -1;
+    e->pa = 0;
+    swap.ins++;
+    if (!mine)
+      swap.hits++;
+    release(&swap.lock);
+
+  install:
+    acquire(tlock);
+    pte = walk(pagetable, va, 0);
+    if (pte && (*pte & PTE_PG) && PTE2IDX(*pte) == slot) {
+      *pte = PTE_PGIN(pa, PTE_FLAGS(*pte));
+      rmap_add(pagetable, pte);
+      acquire(&swap.lock);
+      slotset(slot, swap.ref[slot] - 1);
+      release(&swap.lock);
+      pa = 0;
+    }
+    release(tlock);
+    if (pa)
+      kfree((void *)pa);
+  }
+}
+
+void
+swapincget(int idx)
+{
+  acquire(&swap.lock);
+  slotset(idx, swap.ref[idx] + 1);
+  release(&swap.lock);
 }
 
 int
 swapdecget(int idx)
 {
-  acquire(&swaplock);
-  int res = --swappg_refcnt[idx];
-  release(&swaplock);
+  acquire(&swap.lock);
+  int res = swap.ref[idx] - 1;
+  slotset(idx, res);
+  release(&swap.lock);
   return res;
 }
 
 int
 swapcollect(void)
 {
-  int n = 0;
-  acquire(&swaplock);
-  for (int i = 0; i < SWAP_SPACE_BLOCKS; i++) 
-    if (swappg_refcnt[i] == 0) n++;
-  release(&swaplock);
-  return n * PGSIZE;
+  return swap.nfree * PGSIZE;
+}
+
+int
+statsswap(char *buf, int sz)
+{
+  return snprintf(buf, sz, "--- swap: slots %d free %d out %d in %d writes %d spills %d read around %d cache hits %d\n",
+                  swap.n, swap.nfree, swap.outs, swap.ins, swap.writes, swap.spills, swap.rareads, swap.hits);
+}
+
+static void
+inactive_add(uint64 pa)
+{
+  acquire(&inactive.lock);
+  int i = (inactive.head + inactive.n) % NINACTIVE;
+  if (inactive.n == NINACTIVE)
+    inactive.head = (inactive.head + 1) % NINACTIVE;  // forget the oldest
+  else
+    inactive.n++;
+  inactive.pa[i] = pa;
+  release(&inactive.lock);
+}
+
+// Age the next budget pages from the clock hand on. Returns the
+// oldest of them that could be swapped out, or 0 if none could.
+static uint64
+clockscan(int budget)
+{
+  uint64 old = 0;
+  int age, minage = 256;
+
+  for (; budget > 0; budget--) {
+    acquire(&inactive.lock);
+    uint64 pa = hand;
+    hand += PGSIZE;
+    if (hand >= PHYSTOP)
+      hand = KERNBASE;
+    release(&inactive.lock);
+    if (krefcnt(pa) == 0 || (age = pageage(pa)) < 0)
+      continue;
+    if (age == 0)
+      inactive_add(pa);
+    if (age < minage) {
+      minage = age;
+      old = pa;
+    }
+  }
+  return old;
+}
+
+// Swap out up to n pages from the inactive list that are still
+// unused, a batch at a time. Returns the number of pages freed.
+int
+reclaim(int n)
+{
+  uint64 pa[RECLAIM_BATCH];
+  int m, r, freed = 0;
+
+  while (freed < n) {
+    m = 0;
+    acquire(&inactive.lock);
+    while (inactive.n > 0 && m < n - freed && m < RECLAIM_BATCH) {
+      uint64 a = inactive.pa[inactive.head];
+      inactive.head = (inactive.head + 1) % NINACTIVE;
+      inactive.n--;
+      if (rmap_pin(a))
+        pa[m++] = a;
+    }
+    release(&inactive.lock);
+    if (m == 0 || (r = swapoutv(pa, m)) < 0)
+      break;
+    freed += r;
+  }
+  return freed;
 }
 
+// Free a page for kalloc() when none is free and none is inactive:
+// drop the swap cache, or move the clock hand on by a bounded
+// stretch and swap out what that finds unused, or else the oldest
+// page it looked at. Returns 1 if it freed a page.
+int
+reclaim_oldest(void)
+{
+  uint64 old;
+  int r;
 
+  if (scdrop() > 0)
+    return 1;
+  for (int tries = 0; tries < 4; tries++) {
+    old = clockscan(RECLAIM_SCAN);
+    if (reclaim(RECLAIM_BATCH) > 0)
+      return 1;
+    if (old == 0 || !rmap_pin(old))
+      continue;
+    if ((r = swapoutv(&old, 1)) < 0)
+      return 0;
+    if (r > 0)
+      return 1;
+  }
+  return 0;
+}
 
+static void
+kswapd(void)
+{
+  for (;;) {
+    acquire(&tickslock);
+    uint t0 = ticks;
+    while (ticks == t0)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+
+    clockscan(RECLAIM_SCAN);
+    if (kfreepages() < RECLAIM_LOW)
+      while (kfreepages() < RECLAIM_HIGH && reclaim(RECLAIM_BATCH) > 0)
+        ;
+  }
+}
@@ -124,6 +124,7 @@ extern uint64 sys_symlink(void);
 extern uint64 sys_sigsend(void);
 extern uint64 sys_signal(void);
 extern uint64 sys_sigprocmask(void);
+extern uint64 sys_fsync(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -171,6 +172,7 @@ static uint64 (*syscalls[])(void) = {
 [SYS_sigsend] sys_sigsend,
 [SYS_signal] sys_signal,
 [SYS_sigprocmask] sys_sigprocmask,
+[SYS_fsync] sys_fsync,
 };
 
 char *syscall_names[] = {
@@ -218,6 +220,7 @@ char *syscall_names[] = {
   "sigsend",
   "signal",
   "sigprocmask",
+  "fsync",
 };
 
 int syscall_arg_counts[] = {
@@ -265,6 +268,7 @@ int syscall_arg_counts[] = {
   2,   // sigsend
   2,   // signal
   1,   // sigprocmask
+  1,   // fsync
 };
 
 void
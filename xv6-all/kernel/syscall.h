@@ -42,3 +42,4 @@
 #define SYS_sigsend  41
 #define SYS_signal  42
 #define SYS_sigprocmask  43
+#define SYS_fsync  44
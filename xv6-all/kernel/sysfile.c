@@ -25,7 +25,7 @@ argfd(int n, int *pfd, struct file **pf)
   struct file *f;
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= myproc()->nofile || (f=myproc()->ofile[fd]) == 0)
     return -1;
   if(pfd)
     *pfd = fd;
@@ -42,13 +42,16 @@ fdalloc(struct file *f)
   int fd;
   struct proc *p = myproc();
 
-  for(fd = 0; fd < NOFILE; fd++){
+  for(fd = 0; fd < p->nofile; fd++){
     if(p->ofile[fd] == 0){
       p->ofile[fd] = f;
       return fd;
     }
   }
-  return -1;
+  if(fdgrow(p, fd + 1) < 0)
+    return -1;
+  p->ofile[fd] = f;
+  return fd;
 }
 
 uint64
@@ -176,10 +179,12 @@ isdirempty(struct inode *dp)
   int off;
   struct dirent de;
 
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
+  // "." and ".." are not always the first entries
+  // of a hashed directory.
+  for(off=0; off<dp->size; off+=sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("isdirempty: readi");
-    if(de.inum != 0)
+    if(de.inum != 0 && namecmp(de.name, ".") != 0 && namecmp(de.name, "..") != 0)
       return 0;
   }
   return 1;
@@ -189,7 +194,6 @@ uint64
 sys_unlink(void)
 {
   struct inode *ip, *dp;
-  struct dirent de;
   char name[DIRSIZ], path[MAXPATH];
   uint off;
 
@@ -219,9 +223,7 @@ sys_unlink(void)
     goto bad;
   }
 
-  memset(&de, 0, sizeof(de));
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-    panic("unlink: writei");
+  dirunlink(dp, off);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -375,6 +377,7 @@ sys_open(void)
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  f->wrback = (omode & O_WRBACK) && ip->type == T_FILE;
 
   if((omode & O_TRUNC) && ip->type == T_FILE){
     itrunc(ip);
@@ -544,6 +547,9 @@ sys_mmap(void)
   argint(5, &offset);
   if (fd == -1) return vma_create(addr, length, prot, flags, 0, 0, 0, 0, addr == 0 ? DYNAMIC : FIX);
   struct file *f = myproc()->ofile[fd];  
+  // a shared mapping uses the cached disk blocks, so they must
+  // hold what has been written.
+  if (f && f->type == FD_INODE && (flags & MAP_SHARED)) wbflush(f->ip);
   return vma_create(addr, length, prot, flags, f, f->ip, offset, length, addr == 0 ? DYNAMIC : FIX);  
 }
 
@@ -559,6 +565,20 @@ sys_munmap(void)
   return munmap(addr, length);
 }
 
+// Write the file's delayed (O_WRBACK) data to disk.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type == FD_INODE && wbflush(f->ip) < 0)
+    return -1;
+  log_force();
+  return 0;
+}
+
 uint64
 sys_symlink(void)
 {
@@ -2,4 +2,12 @@ struct sysinfo {
   uint64 freemem;   // amount of free memory (bytes)
   uint64 nproc;     // number of process
   float loadavg1m;  // load average in past 1 minute
+  uint64 zeropages; // pre-zeroed pages ready to allocate
+  uint64 zerohits;  // zeroed page allocations served from them
+  uint64 zeromisses; // and those that had to zero a page
+  uint64 zswapped;  // swapped-out pages held compressed in memory
+  uint64 zswappool; // pages the compressed pool takes
+  uint64 zswapbytes; // compressed size of the pages it holds
+  uint64 zswaphits; // swap faults served from the pool
+  uint64 zswapmisses; // and those that went to disk
 };
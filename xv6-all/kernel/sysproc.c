@@ -101,7 +101,7 @@ sys_pgaccess(void)
   {
     pte = walk(pagetable, buf, 0);
     if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0) continue;
-    if (PTE2PA(*pte) >= PHYSTOP) pgsize = SUPPGSIZE;
+    if (IS_SUPPG(PTE2PA(*pte))) pgsize = SUPPGSIZE;
     if((*pte & PTE_A) == 0) continue;
     abits |= (1 << i);
     *pte &= ~PTE_A;
@@ -206,6 +206,9 @@ sys_sysinfo(void)
   info.freemem = kcollect() + swapcollect();
 	info.nproc = proc_number();
   info.loadavg1m = get_avgload_1m();
+  kzeroinfo(&info.zeropages, &info.zerohits, &info.zeromisses);
+  zswapinfo(&info.zswapped, &info.zswappool, &info.zswapbytes,
+            &info.zswaphits, &info.zswapmisses);
   if(copyout(p->pagetable, addr, (char *)&info, sizeof(info)) < 0)
     return -1;
   return 0;
@@ -46,6 +46,11 @@ usertrap(void)
   // since we're now in the kernel.
   w_stvec((uint64)kernelvec);
 
+  // uservec flushed the user entries from the TLB.
+  struct cpu *c = mycpu();
+  __atomic_store_n(&c->upt, 0, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&c->utraps, 1, __ATOMIC_RELEASE);
+
   struct proc *p = myproc();
   
   // save user program counter.
@@ -152,6 +157,8 @@ usertrapret(void)
 
   // tell trampoline.S the user page table to switch to.
   uint64 satp = MAKE_SATP(p->pagetable);
+  __atomic_store_n(&mycpu()->upt, p->pagetable, __ATOMIC_RELEASE);
+  __sync_synchronize();
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -194,10 +201,6 @@ kerneltrap()
 void
 clockintr()
 {
-  if (ticks % 10 == 0)
-  {
-    update_page_age();
-  }
   acquire(&tickslock);
   ticks++;
   if (ticks % 10 == 0)
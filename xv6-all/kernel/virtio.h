@@ -45,9 +45,11 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
-// this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// at most this many virtio descriptors.
+// must be a power of two. the size actually used is
+// negotiated against the device's QUEUE_NUM_MAX and
+// kept in disk.qsize.
+#define NUM 64
 
 // a single descriptor, from the spec.
 struct virtq_desc {
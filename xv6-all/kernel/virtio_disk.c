@@ -22,7 +22,7 @@
 static struct disk {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
-  // disk operations. there are NUM descriptors.
+  // disk operations. there are qsize descriptors.
   // most commands consist of a "chain" (a linked list) of a couple of
   // these descriptors.
   struct virtq_desc *desc;
@@ -30,26 +30,33 @@ static struct disk {
   // a ring in which the driver writes descriptor numbers
   // that the driver would like the device to process.  it only
   // includes the head descriptor of each chain. the ring has
-  // NUM elements.
+  // qsize elements.
   struct virtq_avail *avail;
 
   // a ring in which the device writes descriptor numbers that
   // the device has finished processing (just the head of each chain).
-  // there are NUM used ring entries.
+  // there are qsize used ring entries.
   struct virtq_used *used;
 
   // our own book-keeping.
+  uint32 qsize;    // negotiated queue size, <= NUM.
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
+  int inflight;    // requests submitted but not yet completed.
+  int maxinflight; // high-water mark of inflight.
+  uint64 nreq;     // requests completed.
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
     char status;
   } info[NUM];
 
+  // the buffer each data descriptor points into, so that
+  // every buffer of a chain can be completed when it finishes.
+  struct buf *bufs[NUM];
+
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
@@ -114,8 +121,11 @@ virtio_disk_init(void)
   uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
+  if(max < 8)
     panic("virtio disk max queue too short");
+  disk.qsize = NUM;
+  while(disk.qsize > max)
+    disk.qsize >>= 1;
 
   // allocate and zero queue memory.
   disk.desc = kalloc();
@@ -128,7 +138,7 @@ virtio_disk_init(void)
   memset(disk.used, 0, PGSIZE);
 
   // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  *R(VIRTIO_MMIO_QUEUE_NUM) = disk.qsize;
 
   // write physical addresses.
   *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
@@ -141,9 +151,10 @@ virtio_disk_init(void)
   // queue is ready.
   *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
 
-  // all NUM descriptors start out unused.
+  // all descriptors start out unused; the ones past
+  // qsize stay marked busy so they are never handed out.
   for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+    disk.free[i] = i < disk.qsize;
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
@@ -156,7 +167,7 @@ virtio_disk_init(void)
 static int
 alloc_desc()
 {
-  for(int i = 0; i < NUM; i++){
+  for(int i = 0; i < disk.qsize; i++){
     if(disk.free[i]){
       disk.free[i] = 0;
       return i;
@@ -169,7 +180,7 @@ alloc_desc()
 static void
 free_desc(int i)
 {
-  if(i >= NUM)
+  if(i >= disk.qsize)
     panic("free_desc 1");
   if(disk.free[i])
     panic("free_desc 2");
@@ -196,12 +207,12 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
+// a transfer of k blocks uses k+2 descriptors.
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +223,35 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// start one request that transfers the n consecutive blocks
+// bs[0..n-1], one data descriptor per buffer.
+static void
+submit_chain(struct buf **bs, int n, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint64 sector = bs[0]->blockno * (BSIZE / 512);
+
+  for(int i = 1; i < n; i++)
+    if(bs[i]->blockno != bs[0]->blockno + i)
+      panic("virtio_disk_submitv: not contiguous");
 
   acquire(&disk.vdisk_lock);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // one descriptor for type/reserved/sector, the data, and one
+  // for a 1-byte status result. the data may be split over
+  // any number of descriptors, so a run of buffers is chained
+  // between the header and the status.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
+  int idx[NUM];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(allocn_desc(idx, n + 2) == 0) {
       break;
     }
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,27 +268,30 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 1; i <= n; i++){
+    struct buf *b = bs[i-1];
+    disk.desc[idx[i]].addr = (uint64) b->data;
+    disk.desc[idx[i]].len = BSIZE;
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads b->data
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+    // record struct buf for virtio_disk_intr().
+    b->disk = 1;
+    disk.bufs[idx[i]] = b;
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.info[idx[0]].status = 0xff; // device writes 0 on success
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  disk.avail->ring[disk.avail->idx % disk.qsize] = idx[0];
 
   __sync_synchronize();
 
@@ -280,17 +302,55 @@ virtio_disk_rw(struct buf *b, int write)
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+  disk.inflight++;
+  if(disk.inflight > disk.maxinflight)
+    disk.maxinflight = disk.inflight;
+
+  release(&disk.vdisk_lock);
+}
+
+// start a read or write of the n buffers bs[0..n-1], which must
+// hold consecutive blocks, and return without waiting. the run is
+// sent as a single request if it fits in the ring. each buffer
+// completes on its own from virtio_disk_intr(), which clears
+// b->disk and wakes up anyone in virtio_disk_wait().
+void
+virtio_disk_submitv(struct buf **bs, int n, int write)
+{
+  while(n > 0){
+    int m = n;
+    if(m > disk.qsize - 2)
+      m = disk.qsize - 2;
+    submit_chain(bs, m, write);
+    bs += m;
+    n -= m;
   }
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+void
+virtio_disk_submit(struct buf *b, int write)
+{
+  submit_chain(&b, 1, write);
+}
 
+// wait for a request started by virtio_disk_submit() to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  while(b->disk == 1) {
+    sleep(b, &disk.vdisk_lock);
+  }
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(b, write);
+  virtio_disk_wait(b);
+}
+
 void
 virtio_disk_intr()
 {
@@ -311,17 +371,46 @@ virtio_disk_intr()
 
   while(disk.used_idx != disk.used->idx){
     __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+    int id = disk.used->ring[disk.used_idx % disk.qsize].id;
 
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    // the chain is finished with; complete each of its buffers
+    // and free it here rather than in the submitter, so that the
+    // descriptors can be reused before the waiters get to run.
+    for(int i = id; ; i = disk.desc[i].next){
+      struct buf *b = disk.bufs[i];
+      if(b){
+        disk.bufs[i] = 0;
+        b->disk = 0;   // disk is done with buf
+        if(b->flags & B_ASYNC)
+          biodone(b);  // nobody waits for read-ahead
+        else
+          wakeup(b);
+      }
+      if(!(disk.desc[i].flags & VRING_DESC_F_NEXT))
+        break;
+    }
+    free_chain(id);
+    disk.inflight--;
+    disk.nreq++;
 
     disk.used_idx += 1;
   }
 
   release(&disk.vdisk_lock);
 }
+
+// report queue statistics through the stats device.
+int
+statsdisk(char *buf, int sz)
+{
+  int n;
+
+  acquire(&disk.vdisk_lock);
+  n = snprintf(buf, sz, "--- disk: qsize %d requests %d max in flight %d\n",
+               disk.qsize, (int)disk.nreq, disk.maxinflight);
+  release(&disk.vdisk_lock);
+  return n;
+}
@@ -8,6 +8,7 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "proc.h"
+#include "fcntl.h"
 
 /*
  * the kernel's page table.
@@ -84,7 +85,7 @@ kvmmake(void)
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
-  kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP_INCLUDESUPPG-(uint64)etext, PTE_R | PTE_W);
+  kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
   // the highest virtual address in the kernel.
@@ -147,9 +148,8 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
         return pte;
       }
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
@@ -263,6 +263,7 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     
     if((pte = walk(pagetable, a, 0)) == 0)
       continue;
+    rmap_remove(pte);
     if(*pte & PTE_PG){
       *pte &= (~PTE_PG);
       swapdecget(PTE2IDX(*pte));
@@ -291,10 +292,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -308,8 +308,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -327,17 +326,17 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
+    rmap_add(pagetable, walk(pagetable, a, 0));
   }
   return newsz;
 }
@@ -398,41 +397,52 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 // its memory into a child's page table.
 // Copies both the page table and the
 // physical memory.
+// tlock is the parent's, under which each PTE is read and
+// marked copy-on-write, so the swap code can't change it between.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 sz, struct spinlock *tlock)
 {
-  pte_t *pte;
+  pte_t *pte, e;
   uint64 pa, i;
   int ret = 0;
 
   for(i = 0; i < sz; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
       continue;
-    if ((*pte & PTE_PG) && swappageclone(pte, new, i) < 0) goto err;
-    if((*pte & PTE_V) == 0) 
+    acquire(tlock);
+    e = *pte;
+    if(e & PTE_PG)
+      swapincget((int)PTE2IDX(e));
+    else if((e & PTE_V) && !IS_SUPPG(PTE2PA(e))){
+      if (e & PTE_W) *pte = e = PTE_ENCOW(e);
+      kincget((void *)PTE2PA(e));
+    }
+    release(tlock);
+    if ((e & PTE_PG) && swappageclone(e, new, i) < 0) goto err;
+    if((e & PTE_V) == 0) 
       continue;
-    pa = PTE2PA(*pte);
+    pa = PTE2PA(e);
     if (IS_SUPPG(pa)){
       char *mem;
       if((mem = kalloc_suppage()) == 0) goto err;
       memmove(mem, (char*)pa, SUPPGSIZE);
-      if(mappages(new, i, SUPPGSIZE, (uint64)mem, PTE_FLAGS(*pte)) != 0){
+      if(mappages(new, i, SUPPGSIZE, (uint64)mem, PTE_FLAGS(e)) != 0){
         kfree_suppage(mem);
         goto err;
       }
       i += SUPPGSIZE - PGSIZE;
       continue;
     }
-    if (*pte & PTE_W) *pte = PTE_ENCOW(*pte);
-    kincget((void *)pa);
-    if(mappages(new, i, PGSIZE, pa, PTE_FLAGS(*pte)) != 0) {
+    if(mappages(new, i, PGSIZE, pa, PTE_FLAGS(e)) != 0) {
+      kfree((void *)pa);
     err:  
       uvmunmap(new, 0, i / PGSIZE, 1);
       ret = -1;
       break;
     }
+    rmap_add(new, walk(new, i, 0));
   }
   saved_page(i / PGSIZE);
   saved_byte(i);
@@ -461,22 +471,44 @@ copyonwrite(pte_t *pte)
   struct proc *p = myproc();
   acquiresleep(&p->tshared->slock);
   acquire(&p->tshared->tlock);
-  if (*pte & PTE_W) goto success;
+  // swapped out since the caller looked: the access will fault
+  // again, and page it in.
+  if ((*pte & PTE_V) == 0 || (*pte & PTE_W)) goto success;
   char *mem;
   uint64 pa = PTE2PA(*pte);
   if (IS_SUPPG(pa)) panic("copyonwrite");
   uint flags = PTE_FLAGS(*pte);
+  if (krefcnt(pa) == 1) {
+    // the last reference: keep the page.
+    *pte = PTE_DECOW(*pte);
+    goto success;
+  }
+  // hold the page while copying it; that also keeps it from
+  // being swapped out.
+  kincget((void *)pa);
   release(&p->tshared->tlock);
-  if ((mem = kalloc_cow(pte)) == 0) {
+  if ((mem = kalloc()) == 0) {
+    kfree((void *)pa);
     releasesleep(&p->tshared->slock);
     return -1;
   }
-  acquire(&p->tshared->tlock);
-  if ((uint64)mem == pa) goto success;
-  *pte = (PA2PTE((uint64)mem) | PTE_DECOW(flags));
   memmove(mem, (char*)pa, PGSIZE);
-  saved_page(-1);
-  saved_byte(-PGSIZE);
+  acquire(&p->tshared->tlock);
+  if ((*pte & PTE_V) && PTE2PA(*pte) == pa && (*pte & PTE_W) == 0) {
+    rmap_remove(pte);
+    *pte = (PA2PTE((uint64)mem) | PTE_DECOW(flags));
+    rmap_add(p->pagetable, pte);
+    kfree((void *)pa);  // the PTE's reference
+    mem = 0;
+    saved_page(-1);
+    saved_byte(-PGSIZE);
+  }
+  release(&p->tshared->tlock);
+  kfree((void *)pa);
+  if (mem)
+    kfree(mem);
+  releasesleep(&p->tshared->slock);
+  return 0;
 success:
   release(&p->tshared->tlock);
   releasesleep(&p->tshared->slock); 
@@ -522,7 +554,7 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   uint64 n, va0, pa0;
   pte_t *pte;
 
-  int pgsize;
+  int pgsize, pin;
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
     if(va0 >= MAXVA)
@@ -539,11 +571,21 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
       if(copyonwrite(pte)) 
         return -1;
     pa0 = PTE2PA(*pte);
+    // pin the page so that it can't be swapped out while it is
+    // written here, then check that it wasn't already.
+    pin = rmap_pin(pa0);
+    if((*pte & (PTE_V|PTE_W)) != (PTE_V|PTE_W) || PTE2PA(*pte) != pa0){
+      if(pin)
+        kfree((void *)pa0);
+      continue;
+    }
     pgsize = IS_SUPPG(pa0) ? SUPPGSIZE : PGSIZE;
     n = pgsize - (dstva - va0);
     if(n > len)
       n = len;
     memmove((void *)(pa0 + (dstva - va0)), src, n);
+    if(pin)
+      kfree((void *)pa0);
 
     len -= n;
     src += n;
@@ -552,6 +594,74 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   return 0;
 }
 
+// Move the block in b to the user page at page-aligned dstva by
+// exchanging that page for b's page, rather than copying it.
+// Only done if the page is present, writable, and belongs to p
+// alone: not a MAP_SHARED page (which is itself a buffer cache
+// page), a superpage, or a page of a process with threads, whose
+// other harts could still hold the old page in their TLBs. This
+// hart flushes its TLB when it returns to user space.
+// Return 0 on success, -1 if the caller must copy instead.
+int
+copyout_buf(struct proc *p, uint64 dstva, struct buf *b)
+{
+  pte_t *pte;
+  uint64 pa;
+  uchar *mem;
+  int ret = -1;
+
+  if(dstva % PGSIZE || dstva >= MAXVA || p->isthread)
+    return -1;
+  acquire(&p->tshared->tlock);
+  pte = walk(p->pagetable, dstva, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_R|PTE_W)) != (PTE_V|PTE_U|PTE_R|PTE_W))
+    goto out;
+  pa = PTE2PA(*pte);
+  if(IS_SUPPG(pa))
+    goto out;
+  for(int i = 0; i < MAX_VMA; i++){
+    struct vma *v = &p->tshared->vm_areas[i];
+    if(v->used && (v->flags & MAP_SHARED) && v->addr <= dstva && dstva < v->addr + v->length)
+      goto out;
+  }
+  if(threaded(p) || (mem = bexchange(b, (uchar*)pa)) == 0)
+    goto out;
+  rmap_remove(pte);
+  *pte = PA2PTE((uint64)mem) | PTE_FLAGS(*pte);
+  rmap_add(p->pagetable, pte);
+  ret = 0;
+out:
+  release(&p->tshared->tlock);
+  return ret;
+}
+
+// Find the user page at va0 for the kernel to read, faulting it
+// in if need be, and pin it with rmap_pin() so that it can't be
+// swapped out and reused meanwhile; *pin says whether it was, for
+// the caller to kfree() it when done. Returns 1 and sets *pa, 0 if
+// the page went out again before it was pinned (try again), or -1
+// if va0 is not mapped.
+static int
+pinuser(pagetable_t pagetable, uint64 va0, uint64 *pa, int *pin)
+{
+  uint64 va = va0, pa0;
+
+  if((pa0 = walkaddr(pagetable, va)) == 0) {
+    int suppg = vma_handle(myproc(), va0);
+    if(suppg < 0) return -1;
+    if(suppg) va = SUPPGROUNDDOWN(va0);
+    if((pa0 = walkaddr(pagetable, va)) == 0) return 0;
+  }
+  *pin = rmap_pin(pa0);
+  if(walkaddr(pagetable, va) != pa0) {
+    if(*pin)
+      kfree((void *)pa0);
+    return 0;
+  }
+  *pa = pa0;
+  return 1;
+}
+
 // Copy from user to kernel.
 // Copy len bytes to dst from virtual address srcva in a given page table.
 // Return 0 on success, -1 on error.
@@ -561,20 +671,20 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   uint64 n, va0, pa0;
   
 
-  int pgsize;
+  int pgsize, pin, r;
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0) {
-      int suppg = vma_handle(myproc(), va0);
-      if(suppg < 0) return -1;
-      pa0 = walkaddr(pagetable, suppg ? SUPPGROUNDDOWN(va0) : va0);
-    }
+    if((r = pinuser(pagetable, va0, &pa0, &pin)) < 0)
+      return -1;
+    if(r == 0)
+      continue;
     pgsize = IS_SUPPG(pa0) ? SUPPGSIZE : PGSIZE;
     n = pgsize - (srcva - va0);
     if(n > len)
       n = len;
     memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    if(pin)
+      kfree((void *)pa0);
 
     len -= n;
     dst += n;
@@ -592,16 +702,14 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
   uint64 n, va0, pa0;
   int got_null = 0;
-  int pgsize;
+  int pgsize, pin, r;
   
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0) {
-      int suppg = vma_handle(myproc(), va0);
-      if(suppg < 0) return -1;
-      pa0 = walkaddr(pagetable, suppg ? SUPPGROUNDDOWN(va0) : va0);
-    }
+    if((r = pinuser(pagetable, va0, &pa0, &pin)) < 0)
+      return -1;
+    if(r == 0)
+      continue;
     pgsize = IS_SUPPG(pa0) ? SUPPGSIZE : PGSIZE;
     n = pgsize - (srcva - va0);
 
@@ -622,6 +730,8 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
+    if(pin)
+      kfree((void *)pa0);
 
     srcva = va0 + pgsize;
   }
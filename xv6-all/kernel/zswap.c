@@ -0,0 +1,311 @@
+// Compressed swap pool.
+//
+// Pages the reclaim code swaps out are first compressed, with an
+// LZJB-style compressor, into a pool of at most ZSWAP_POOL pages,
+// and only go to the on-disk swap region if they don't compress
+// or the pool is full. A page stays named by its swap slot either
+// way, so PTEs don't change; zloc[slot] says where in the pool the
+// slot's page is, if it is there.
+//
+// The pool is carved into ZCHUNK-byte chunks, 64 to a page; a
+// compressed page takes a run of chunks within one pool page,
+// starting with its length. When the pool is full, the swap code
+// spills the oldest pages in it to disk to make room.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define ZCHUNK  (PGSIZE / 64)
+#define ZMAXLEN (PGSIZE * 3 / 4)   // don't keep pages that compress worse
+
+struct {
+  struct spinlock lock;
+  uint nslot;
+  uint *zloc;                  // per slot: 0, or (pool page + 1) << 6 | chunk
+  uint64 page[ZSWAP_POOL];     // pool pages, 0 if none
+  uint64 used[ZSWAP_POOL];     // chunks in use in each
+  uint npage;                  // pool pages allocated
+  uint nstored;                // compressed pages held
+  uint64 bytes;                // and their total compressed size
+  uint hits, misses;           // faults served from the pool, and not
+} zswap;
+
+// The compressor's state, taken by one page at a time.
+struct {
+  struct sleeplock lock;
+  ushort lempel[1024];
+  uchar out[ZMAXLEN];
+} zcomp;
+
+#define NBBY       8
+#define MATCH_BITS 6
+#define MATCH_MIN  3
+#define MATCH_MAX  ((1 << MATCH_BITS) + (MATCH_MIN - 1))
+#define OFFSET_MASK ((1 << (16 - MATCH_BITS)) - 1)
+
+// Compress the PGSIZE bytes at src into dst, which holds dlen
+// bytes. Returns the compressed length, or 0 if it wouldn't fit.
+// Each copymap byte says which of the next eight items are
+// literals and which are (length, offset) matches.
+static int
+lz_compress(uchar *src, uchar *dst, int dlen)
+{
+  uchar *s = src, *d = dst, *copymap = 0, *cpy;
+  int copymask = 1 << (NBBY - 1);
+  int mlen, offset, hash;
+
+  memset(zcomp.lempel, 0, sizeof(zcomp.lempel));
+  while (s < src + PGSIZE) {
+    if ((copymask <<= 1) == (1 << NBBY)) {
+      if (d >= dst + dlen - 1 - 2 * NBBY)
+        return 0;
+      copymask = 1;
+      copymap = d;
+      *d++ = 0;
+    }
+    if (s > src + PGSIZE - MATCH_MAX) {
+      *d++ = *s++;
+      continue;
+    }
+    hash = (s[0] << 16) + (s[1] << 8) + s[2];
+    hash += hash >> 9;
+    hash += hash >> 5;
+    ushort *hp = &zcomp.lempel[hash & (NELEM(zcomp.lempel) - 1)];
+    offset = (ushort)((uint64)s - *hp) & OFFSET_MASK;
+    *hp = (ushort)(uint64)s;
+    cpy = s - offset;
+    if (cpy >= src && cpy != s && s[0] == cpy[0] && s[1] == cpy[1] && s[2] == cpy[2]) {
+      *copymap |= copymask;
+      for (mlen = MATCH_MIN; mlen < MATCH_MAX; mlen++)
+        if (s[mlen] != cpy[mlen])
+          break;
+      *d++ = ((mlen - MATCH_MIN) << (NBBY - MATCH_BITS)) | (offset >> NBBY);
+      *d++ = (uchar)offset;
+      s += mlen;
+    } else {
+      *d++ = *s++;
+    }
+  }
+  return d - dst;
+}
+
+// Decompress into the PGSIZE bytes at dst.
+static void
+lz_decompress(uchar *src, uchar *dst)
+{
+  uchar *d = dst, *cpy, copymap = 0;
+  int copymask = 1 << (NBBY - 1);
+  int mlen, offset;
+
+  while (d < dst + PGSIZE) {
+    if ((copymask <<= 1) == (1 << NBBY)) {
+      copymask = 1;
+      copymap = *src++;
+    }
+    if (copymap & copymask) {
+      mlen = (src[0] >> (NBBY - MATCH_BITS)) + MATCH_MIN;
+      offset = ((src[0] << NBBY) | src[1]) & OFFSET_MASK;
+      src += 2;
+      if ((cpy = d - offset) < dst)
+        panic("lz_decompress");
+      if (mlen > dst + PGSIZE - d)
+        mlen = dst + PGSIZE - d;
+      while (--mlen >= 0)
+        *d++ = *cpy++;
+    } else {
+      *d++ = *src++;
+    }
+  }
+}
+
+void
+zswapinit(int nslot)
+{
+  int order = 0;
+
+  initlock(&zswap.lock, "zswap");
+  initsleeplock(&zcomp.lock, "zcomp");
+  zswap.nslot = nslot;
+  if (nslot == 0)
+    return;
+  while ((PGSIZE << order) < nslot * sizeof(uint))
+    order++;
+  if ((zswap.zloc = kalloc_pages(order)) == 0)
+    panic("zswapinit");
+  memset(zswap.zloc, 0, nslot * sizeof(uint));
+}
+
+static uint64
+zaddr(uint loc)
+{
+  return zswap.page[(loc >> 6) - 1] + (loc & 63) * ZCHUNK;
+}
+
+static int
+zchunks(uint loc)
+{
+  return (*(ushort *)zaddr(loc) + sizeof(ushort) + ZCHUNK - 1) / ZCHUNK;
+}
+
+// Find a run of n free chunks, adding a pool page if need be.
+// Returns its location, or 0 if the pool is full.
+// Caller holds zswap.lock.
+static uint
+zalloc(int n)
+{
+  uint64 mask = n == 64 ? ~0ULL : ((1ULL << n) - 1);
+  int i, c, empty = -1;
+
+  for (i = 0; i < ZSWAP_POOL; i++) {
+    if (zswap.page[i] == 0) {
+      if (empty < 0)
+        empty = i;
+      continue;
+    }
+    for (c = 0; c + n <= 64; c++)
+      if ((zswap.used[i] & (mask << c)) == 0)
+        goto found;
+  }
+  if (empty < 0 || (zswap.page[empty] = (uint64)kalloc_noswap()) == 0)
+    return 0;
+  zswap.npage++;
+  i = empty;
+  c = 0;
+found:
+  zswap.used[i] |= mask << c;
+  return (i + 1) << 6 | c;
+}
+
+// Compress the page at pa into the pool as slot's. Returns 1 if it
+// is there, 0 if it doesn't compress well, -1 if the pool is full.
+int
+zstore(int slot, uint64 pa)
+{
+  int len, r = 1;
+  uint loc;
+
+  if (zswap.nslot == 0)
+    return 0;
+  acquiresleep(&zcomp.lock);
+  if ((len = lz_compress((uchar *)pa, zcomp.out, ZMAXLEN - sizeof(ushort))) == 0) {
+    releasesleep(&zcomp.lock);
+    return 0;
+  }
+  acquire(&zswap.lock);
+  if ((loc = zalloc((len + sizeof(ushort) + ZCHUNK - 1) / ZCHUNK)) == 0) {
+    r = -1;
+  } else {
+    *(ushort *)zaddr(loc) = len;
+    memmove((char *)zaddr(loc) + sizeof(ushort), zcomp.out, len);
+    zswap.zloc[slot] = loc;
+    zswap.nstored++;
+    zswap.bytes += len;
+  }
+  release(&zswap.lock);
+  releasesleep(&zcomp.lock);
+  return r;
+}
+
+// Free the pool chunks at loc. Caller holds zswap.lock.
+static void
+zfree(int slot, uint loc)
+{
+  int i = (loc >> 6) - 1, n = zchunks(loc);
+
+  zswap.bytes -= *(ushort *)zaddr(loc);
+  zswap.nstored--;
+  zswap.used[i] &= ~((n == 64 ? ~0ULL : ((1ULL << n) - 1)) << (loc & 63));
+  zswap.zloc[slot] = 0;
+  if (zswap.used[i] == 0) {
+    kfree((void *)zswap.page[i]);
+    zswap.page[i] = 0;
+    zswap.npage--;
+  }
+}
+
+// Is slot's page in the pool?
+int
+zhas(int slot)
+{
+  return zswap.nslot && zswap.zloc[slot] != 0;
+}
+
+// If slot's page is in the pool, decompress it into the page at
+// pa and return 1. Otherwise return 0: it is on disk.
+int
+zload(int slot, uint64 pa)
+{
+  int r = 0;
+
+  if (zswap.nslot == 0)
+    return 0;
+  acquire(&zswap.lock);
+  if (zswap.zloc[slot]) {
+    lz_decompress((uchar *)zaddr(zswap.zloc[slot]) + sizeof(ushort), (uchar *)pa);
+    zswap.hits++;
+    r = 1;
+  } else {
+    zswap.misses++;
+  }
+  release(&zswap.lock);
+  return r;
+}
+
+// slot has been freed: drop its page from the pool.
+void
+zdrop(int slot)
+{
+  if (zswap.nslot == 0)
+    return;
+  acquire(&zswap.lock);
+  if (zswap.zloc[slot])
+    zfree(slot, zswap.zloc[slot]);
+  release(&zswap.lock);
+}
+
+// Choose the first slot from from on whose page is in the pool,
+// to go to disk, and decompress it into buf. Returns the slot, or
+// -1 if the pool is empty. Call zspilled() once it is on disk.
+int
+zspill(int from, uint64 buf)
+{
+  int slot = -1;
+
+  if (zswap.nslot == 0)
+    return -1;
+  acquire(&zswap.lock);
+  for (int k = 0; k < zswap.nslot && zswap.nstored > 0; k++) {
+    int i = (from + k) % zswap.nslot;
+    if (zswap.zloc[i]) {
+      lz_decompress((uchar *)zaddr(zswap.zloc[i]) + sizeof(ushort), (uchar *)buf);
+      slot = i;
+      break;
+    }
+  }
+  release(&zswap.lock);
+  return slot;
+}
+
+// slot's page, which zspill() chose, is on disk now.
+void
+zspilled(int slot)
+{
+  zdrop(slot);
+}
+
+void
+zswapinfo(uint64 *stored, uint64 *pool, uint64 *bytes, uint64 *hits, uint64 *misses)
+{
+  acquire(&zswap.lock);
+  *stored = zswap.nstored;
+  *pool = zswap.npage;
+  *bytes = zswap.bytes;
+  *hits = zswap.hits;
+  *misses = zswap.misses;
+  release(&zswap.lock);
+}
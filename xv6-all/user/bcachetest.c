@@ -8,6 +8,7 @@
 
 void test0();
 void test1();
+void test2();
 
 #define SZ 4096
 char buf[SZ];
@@ -17,6 +18,7 @@ main(int argc, char *argv[])
 {
   test0();
   test1();
+  test2();
   exit(0);
 }
 
@@ -188,3 +190,41 @@ void test1()
   }
   printf("test1 OK\n");
 }
+
+// find "name N" in the stats output and return N.
+int
+statval(char *name)
+{
+  int n = strlen(name);
+
+  for(char *c = buf; *c; c++)
+    if(strncmp(c, name, n) == 0 && c[n] == ' ')
+      return atoi(c+n+1);
+  return -1;
+}
+
+// Report the cache hit rate for working sets smaller and larger
+// than the cache.
+void test2()
+{
+  char *file = "C";
+  enum { PASSES = 3 };
+
+  printf("start test2: cache of %d buffers\n", NBUF);
+  unlink(file);
+  createfile(file, 2*NBUF);
+  for(int ws = NBUF/4; ws <= 2*NBUF; ws *= 2){
+    ntas(0);
+    int h = statval("hits");
+    int m = statval("misses");
+    for(int i = 0; i < PASSES; i++)
+      readfile(file, ws*BSIZE, BSIZE);
+    ntas(0);
+    h = statval("hits") - h;
+    m = statval("misses") - m;
+    printf("test2: working set %d blocks: hits %d misses %d hit rate %d%%\n",
+           ws, h, m, h+m > 0 ? h*100/(h+m) : 0);
+  }
+  unlink(file);
+  printf("test2 OK\n");
+}
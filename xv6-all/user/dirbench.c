@@ -0,0 +1,97 @@
+// Measure how the cost of creating, looking up and removing a
+// name grows with the number of names in a directory. The names
+// are links to one file, so the test needs only one inode.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define MAXNAMES 2000
+
+void
+name(char *buf, int i)
+{
+  buf[0] = 'd';
+  buf[1] = 'b';
+  buf[2] = '/';
+  buf[3] = 'n';
+  buf[4] = '0' + i / 1000;
+  buf[5] = '0' + (i / 100) % 10;
+  buf[6] = '0' + (i / 10) % 10;
+  buf[7] = '0' + i % 10;
+  buf[8] = '\0';
+}
+
+int
+elapsed(int start)
+{
+  int t = uptime() - start;
+  return t > 0 ? t : 1;
+}
+
+void
+run(int n)
+{
+  char buf[9];
+  struct stat st;
+  int start, tc, tl, tu;
+
+  start = uptime();
+  for(int i = 0; i < n; i++){
+    name(buf, i);
+    if(link("db/f", buf) < 0){
+      printf("dirbench: link %s failed\n", buf);
+      exit(1);
+    }
+  }
+  tc = elapsed(start);
+
+  start = uptime();
+  for(int i = 0; i < n; i++){
+    name(buf, (i * 7) % n);
+    if(stat(buf, &st) < 0){
+      printf("dirbench: stat %s failed\n", buf);
+      exit(1);
+    }
+  }
+  tl = elapsed(start);
+
+  start = uptime();
+  for(int i = 0; i < n; i++){
+    name(buf, i);
+    if(unlink(buf) < 0){
+      printf("dirbench: unlink %s failed\n", buf);
+      exit(1);
+    }
+  }
+  tu = elapsed(start);
+
+  printf("%d names: create %d ticks, lookup %d ticks, unlink %d ticks\n",
+         n, tc, tl, tu);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd;
+
+  unlink("db/f");
+  unlink("db");
+  if(mkdir("db") < 0 || (fd = open("db/f", O_CREATE | O_WRONLY)) < 0){
+    printf("dirbench: cannot create db/f\n");
+    exit(1);
+  }
+  close(fd);
+
+  for(int n = 250; n <= MAXNAMES; n *= 2)
+    run(n);
+
+  unlink("db/f");
+  if(unlink("db") < 0){
+    printf("dirbench: db not empty\n");
+    exit(1);
+  }
+  printf("dirbench: done\n");
+  exit(0);
+}
@@ -0,0 +1,123 @@
+// Measure how disk read throughput scales with the number of
+// requests in flight. Each of NPROC readers streams through its
+// own file, which is larger than the buffer cache, so nearly
+// every read() is a disk request; running d readers at once keeps
+// up to d requests queued at the virtio disk.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/param.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+#define NREADER 8
+#define FILEBLKS 300    // blocks per file; keep it larger than NBUF
+#define TOTBLKS 1200    // blocks read per depth, split among readers
+
+char buf[BSIZE];
+
+void
+fname(char *name, int i)
+{
+  name[0] = 'i';
+  name[1] = 'o';
+  name[2] = '0' + i;
+  name[3] = '\0';
+}
+
+void
+createfile(int i)
+{
+  char name[4];
+  int fd;
+
+  fname(name, i);
+  unlink(name);
+  fd = open(name, O_CREATE | O_WRONLY);
+  if(fd < 0){
+    printf("iopsbench: create %s failed\n", name);
+    exit(1);
+  }
+  for(int b = 0; b < FILEBLKS; b++){
+    buf[0] = b;
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("iopsbench: write %s failed\n", name);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+// read nblks blocks of file i, starting over at the end.
+void
+reader(int i, int nblks)
+{
+  char name[4];
+  int fd = -1;
+
+  fname(name, i);
+  for(int b = 0; b < nblks; b++){
+    if(b % FILEBLKS == 0){
+      if(fd >= 0)
+        close(fd);
+      if((fd = open(name, O_RDONLY)) < 0){
+        printf("iopsbench: open %s failed\n", name);
+        exit(1);
+      }
+    }
+    if(read(fd, buf, BSIZE) != BSIZE){
+      printf("iopsbench: read %s failed\n", name);
+      exit(1);
+    }
+  }
+  close(fd);
+  exit(0);
+}
+
+int
+run(int depth)
+{
+  int start, t;
+
+  start = uptime();
+  for(int i = 0; i < depth; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("iopsbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      reader(i, TOTBLKS / depth);
+  }
+  for(int i = 0; i < depth; i++){
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+  t = uptime() - start;
+  return t > 0 ? t : 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  printf("iopsbench: creating %d files of %d blocks\n", NREADER, FILEBLKS);
+  for(int i = 0; i < NREADER; i++)
+    createfile(i);
+
+  for(int depth = 1; depth <= NREADER; depth *= 2){
+    int t = run(depth);
+    printf("depth %d: %d blocks in %d ticks, %d blocks per 100 ticks\n",
+           depth, TOTBLKS, t, TOTBLKS * 100 / t);
+  }
+
+  for(int i = 0; i < NREADER; i++){
+    char name[4];
+    fname(name, i);
+    unlink(name);
+  }
+  printf("iopsbench: done\n");
+  exit(0);
+}
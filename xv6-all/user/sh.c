@@ -159,7 +159,7 @@ char* knowncommands[] = {
     "trace","sysinfo","sysinfotest","nulltest","dirtypages","suppgtest","vmprint","pgtbltest","alarmtest",
     "bttest","threadtest","kthreadtest","uthreadtest","udpserver","tcpclient","wget","tcpechoserver",
     "ping","symlinktest","signaltest","kalloctest","bcachetest","bigfile","nettests","mmaptest","swaptest",
-    "procfstest"
+    "procfstest","iopsbench","writebench","dirbench","swapbench"
 };
 
 char* common_longest_prefix(const char* a, const char* b) {
@@ -0,0 +1,95 @@
+// Measure how fast swapped-out memory comes back. Grow the heap
+// past physical memory so that part of it is swapped out, then
+// touch every page in order, which swap read-around should speed
+// up, and then in random order, which it can't. Reports the
+// kernel's swap statistics after each pass.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/sysinfo.h"
+#include "user/user.h"
+
+#define SPARE 512   // pages of free memory plus swap to leave alone
+
+char stats[4096];
+unsigned long rnd = 1;
+
+int
+rand(void)
+{
+  rnd = rnd * 1103515245 + 12345;
+  return (rnd >> 16) & 0x7fff;
+}
+
+// print the swap line from the statistics device.
+void
+swapstats(void)
+{
+  char *name = "--- swap:";
+  int n = strlen(name);
+
+  if(statistics(stats, sizeof(stats)) <= 0){
+    printf("swapbench: statistics failed\n");
+    exit(1);
+  }
+  for(char *c = stats; *c; c++){
+    if(strncmp(c, name, n) == 0){
+      char *e = strchr(c, '\n');
+      if(e)
+        *e = '\0';
+      printf("%s\n", c);
+      return;
+    }
+  }
+}
+
+void
+pass(char *what, char *base, int npages, int random)
+{
+  int start = uptime(), t;
+
+  for(int i = 0; i < npages; i++){
+    int k = random ? (rand() << 15 | rand()) % npages : i;
+    if(base[k * PGSIZE] != (char)k){
+      printf("swapbench: page %d reads back wrong\n", k);
+      exit(1);
+    }
+  }
+  t = uptime() - start;
+  if(t == 0)
+    t = 1;
+  printf("%s: %d pages in %d ticks, %d pages per 100 ticks\n",
+         what, npages, t, npages * 100 / t);
+  swapstats();
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct sysinfo info;
+  int npages;
+  char *base;
+
+  if(sysinfo(&info) < 0){
+    printf("swapbench: sysinfo failed\n");
+    exit(1);
+  }
+  // freemem counts free swap slots too.
+  npages = info.freemem / PGSIZE - SPARE;
+  if((base = sbrk(npages * PGSIZE)) == (char *)-1){
+    printf("swapbench: sbrk failed\n");
+    exit(1);
+  }
+  int start = uptime();
+  for(int i = 0; i < npages; i++)
+    base[i * PGSIZE] = i;
+  printf("fill: %d pages in %d ticks\n", npages, uptime() - start);
+  swapstats();
+
+  pass("sequential", base, npages, 0);
+  pass("random", base, npages, 1);
+  printf("swapbench: done\n");
+  exit(0);
+}
@@ -10,6 +10,13 @@ sinfo(struct sysinfo *info) {
     exit(1);
   } else {
     printf("%d %d %d\n", info->freemem, info->nproc, (int) info->loadavg1m);
+    printf("zeroed pages %d, hits %d misses %d\n", (int) info->zeropages,
+           (int) info->zerohits, (int) info->zeromisses);
+    int ratio = info->zswapbytes ? info->zswapped * 4096 * 10 / info->zswapbytes : 0;
+    int faults = info->zswaphits + info->zswapmisses;
+    printf("zswap: %d pages in %d pool pages, ratio %d.%d, hits %d of %d faults (%d%%)\n",
+           (int) info->zswapped, (int) info->zswappool, ratio / 10, ratio % 10,
+           (int) info->zswaphits, faults, faults ? (int) info->zswaphits * 100 / faults : 0);
   }
 }
 
@@ -50,6 +50,7 @@ int symlink(const char*, const char*);
 int sigsend(int, int);
 int signal(int, uint64);
 int sigprocmask(int);
+int fsync(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -58,3 +58,4 @@ entry("symlink");
 entry("sigsend");
 entry("signal");
 entry("sigprocmask");
+entry("fsync");
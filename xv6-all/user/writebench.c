@@ -0,0 +1,128 @@
+// Measure write throughput, and the number of log commits it
+// takes, for files of different sizes. Each file is written
+// with a single write() call, which the kernel splits into as
+// few transactions as the log allows, and then again with
+// small writes, first logged one by one and then with O_WRBACK,
+// which leaves them for the flusher (fsync() before close()).
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/param.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+#define TOTBYTES (4*1024*1024)  // bytes to write for each file size
+#define MAXFILES 64             // but no more files than this
+#define MAXSIZE  (1024*1024)
+#define SMALL    512            // bytes per small write
+
+char data[MAXSIZE];
+char stats[4096];
+
+int sizes[] = { 4*1024, 64*1024, 256*1024, 1024*1024 };
+
+// read the number of log commits from the statistics device.
+int
+ncommit(void)
+{
+  char *name = "commits ";
+  int n = strlen(name);
+
+  if(statistics(stats, sizeof(stats)) <= 0){
+    printf("writebench: statistics failed\n");
+    exit(1);
+  }
+  for(char *c = stats; *c; c++)
+    if(strncmp(c, name, n) == 0)
+      return atoi(c+n);
+  return 0;
+}
+
+void
+fname(char *name, int i)
+{
+  name[0] = 'w';
+  name[1] = 'b';
+  name[2] = '0' + i / 10;
+  name[3] = '0' + i % 10;
+  name[4] = '\0';
+}
+
+// check that file name reads back as written.
+void
+check(char *name, int size)
+{
+  static char buf[MAXSIZE];
+  int fd = open(name, O_RDONLY);
+
+  if(fd < 0 || read(fd, buf, size) != size || memcmp(buf, data, size) != 0){
+    printf("writebench: %s reads back wrong\n", name);
+    exit(1);
+  }
+  close(fd);
+}
+
+void
+run(int size, int chunk, int omode)
+{
+  // small logged writes commit one by one, so write less.
+  int nfiles = (chunk < size ? TOTBYTES / 8 : TOTBYTES) / size;
+  char name[5];
+  int start, t, c;
+
+  if(nfiles > MAXFILES)
+    nfiles = MAXFILES;
+  if(nfiles < 1)
+    nfiles = 1;
+
+  c = ncommit();
+  start = uptime();
+  for(int i = 0; i < nfiles; i++){
+    fname(name, i);
+    int fd = open(name, O_CREATE | O_WRONLY | omode);
+    if(fd < 0){
+      printf("writebench: create %s failed\n", name);
+      exit(1);
+    }
+    for(int off = 0; off < size; off += chunk){
+      if(write(fd, data + off, chunk) != chunk){
+        printf("writebench: write %s failed\n", name);
+        exit(1);
+      }
+    }
+    if((omode & O_WRBACK) && fsync(fd) < 0){
+      printf("writebench: fsync %s failed\n", name);
+      exit(1);
+    }
+    close(fd);
+  }
+  t = uptime() - start;
+  c = ncommit() - c;
+  if(t == 0)
+    t = 1;
+  printf("%d KB files, %d byte writes%s: %d files in %d ticks, %d KB per 100 ticks, %d commits\n",
+         size / 1024, chunk, (omode & O_WRBACK) ? " (write-back)" : "",
+         nfiles, t, nfiles * (size / 1024) * 100 / t, c);
+
+  for(int i = 0; i < nfiles; i++){
+    fname(name, i);
+    check(name, size);
+    unlink(name);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  for(int i = 0; i < MAXSIZE; i++)
+    data[i] = i;
+  for(int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    run(sizes[i], sizes[i], 0);
+  for(int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++){
+    run(sizes[i], SMALL, 0);
+    run(sizes[i], SMALL, O_WRBACK);
+  }
+  printf("writebench: done\n");
+  exit(0);
+}